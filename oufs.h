@@ -19,6 +19,9 @@
 // Implementation of min operator
 #define MIN(a, b) (((a) > (b)) ? (b) : (a))
 
+// Implementation of max operator
+#define MAX(a, b) (((a) < (b)) ? (b) : (a))
+
 /**********************************************************************/
 /*
    File system layout onto disk blocks:
@@ -101,6 +104,34 @@ typedef struct inode_block_s
 // Block 0
 #define MASTER_BLOCK_REFERENCE 0
 
+// Optional feature flags.  Images formatted before a feature existed have the
+//  flag clear (the tail of the master block is zero)
+#define FEATURE_SUBTREE_COUNTERS 0x01
+#define FEATURE_PATH_INDEX 0x02
+#define FEATURE_BLOOM_FILTERS 0x04
+
+// Allocated entries of every directory block come first: . and .. in slots
+//  0 and 1, then the others in name order, so lookups can use binary search
+//  and listings need no sort
+#define FEATURE_SORTED_DIRECTORIES 0x08
+
+// A name too long for one directory entry goes on in the entries after it
+//  (see CONTINUATION_INODE)
+#define FEATURE_LONG_NAMES 0x10
+
+// Totals for everything below one directory (the directory's own block included)
+typedef struct subtree_counter_s
+{
+	// Number of directory entries, not counting . and ..
+	unsigned char entries;
+
+	// Number of data blocks
+	unsigned char blocks;
+
+	// Sum of file sizes in bytes
+	unsigned short bytes;
+} SUBTREE_COUNTER;
+
 typedef struct master_block_s
 {
 	// 8 inodes per byte: One inode per bit: 1 = allocated, 0 = free
@@ -110,10 +141,30 @@ typedef struct master_block_s
 	// 8 data blocks per byte: One block per bit: 1 = allocated, 0 = free
 	// Block 0 (the master block) is byte 0, bit 0
 	unsigned char block_allocated_flag[N_BLOCKS_IN_DISK >> 3];
+
+	// The fields below live in what was the unused tail of the block, so
+	//  the layout above is unchanged
+
+	// FEATURE_* flags
+	unsigned char feature_flags;
+
+	// Subtree totals, indexed by directory inode (FEATURE_SUBTREE_COUNTERS)
+	SUBTREE_COUNTER subtree[N_INODES];
+
+	// Changed whenever a directory is removed, so that an inode reference
+	//  saved for a path (ZPWD_INODE) can be checked before it is used
+	unsigned int namespace_generation;
+
+	// Block holding the path index (FEATURE_PATH_INDEX)
+	BLOCK_REFERENCE path_index_block;
+
+	// Block holding the directory Bloom filters (FEATURE_BLOOM_FILTERS)
+	BLOCK_REFERENCE bloom_block;
 } MASTER_BLOCK;
 
 /**********************************************************************/
-// Single directory element
+// Single directory element.  A directory is one block of
+//  DIRECTORY_ENTRIES_PER_BLOCK entries, two of them . and ..
 typedef struct directory_entry_s
 {
 	// Name of file/directory
@@ -127,12 +178,56 @@ typedef struct directory_entry_s
 // Number of directory entries stored in one data block
 #define DIRECTORY_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(DIRECTORY_ENTRY))
 
+// With FEATURE_LONG_NAMES, the entries after a name's own entry that hold
+//  the rest of the name.  The name ends at its first 0 byte, or after the
+//  last of these entries.  A directory inode's size counts them too
+#define CONTINUATION_INODE USHRT_MAX
+
+// Most entries one name can take, and the size of a buffer for such a name
+#define LONG_NAME_ENTRIES 4
+#define LONG_NAME_SIZE (FILE_NAME_SIZE * LONG_NAME_ENTRIES + 1)
+
 // Directory block
 typedef struct directory_block_s
 {
 	DIRECTORY_ENTRY entry[DIRECTORY_ENTRIES_PER_BLOCK];
 } DIRECTORY_BLOCK;
 
+/**********************************************************************/
+// Path index (FEATURE_PATH_INDEX): a hash table from the full path of
+//  every directory but the root to its inode
+
+// Hash of the path "/" (paths are hashed with 32-bit FNV-1a)
+#define PATH_HASH_ROOT 2166136261u
+
+typedef struct path_index_entry_s
+{
+	// Path hash, folded to 16 bits
+	unsigned short hash;
+
+	// Directory and its parent (0 = empty slot: the root is not stored)
+	unsigned char inode_reference;
+	unsigned char parent;
+} PATH_INDEX_ENTRY;
+
+// Number of slots in the table
+#define PATH_INDEX_SLOTS (BLOCK_SIZE / sizeof(PATH_INDEX_ENTRY))
+
+typedef struct path_index_block_s
+{
+	PATH_INDEX_ENTRY entry[PATH_INDEX_SLOTS];
+} PATH_INDEX_BLOCK;
+
+/**********************************************************************/
+// Directory Bloom filters (FEATURE_BLOOM_FILTERS): 32 bits per directory
+//  inode, two bits set for each name in the directory other than . and ..
+//  Removing a name leaves its bits set until the filters are rebuilt
+
+typedef struct bloom_block_s
+{
+	unsigned int filter[N_INODES];
+} BLOOM_BLOCK;
+
 /**********************************************************************/
 // All-encompassing structure for a disk block
 // The union says that all 4 of these elements occupy overlapping bytes in 
@@ -143,6 +238,8 @@ typedef union block_u
 	MASTER_BLOCK master;
 	INODE_BLOCK inodes;
 	DIRECTORY_BLOCK directory;
+	PATH_INDEX_BLOCK path_index;
+	BLOOM_BLOCK bloom;
 } BLOCK;
 
 
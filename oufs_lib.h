@@ -4,27 +4,118 @@
 
 #define MAX_PATH_LENGTH 200
 
+// Result of looking up one path with oufs_stat_many()
+typedef struct oufs_stat_s
+{
+	// 1 = found, 0 = does not exist, < 0 = error
+	int status;
+
+	// Only valid when status is 1
+	INODE_REFERENCE inode_reference;
+	INODE inode;
+} OUFS_STAT;
+
+// One entry found by oufs_walk()
+typedef struct oufs_walk_node_s
+{
+	// Path of the entry, starting with the path given to oufs_walk()
+	char path[MAX_PATH_LENGTH];
+
+	INODE_REFERENCE inode_reference;
+	INODE inode;
+
+	// Index of the containing directory's node (-1 for the starting point)
+	int parent;
+
+	// Number of directories between this entry and the starting point
+	int depth;
+
+	// Children of a directory are stored next to each other, sorted by name
+	int first_child;
+	int n_children;
+} OUFS_WALK_NODE;
+
+// A name read out of a directory block by oufs_directory_names()
+typedef struct oufs_dir_name_s
+{
+	char name[LONG_NAME_SIZE];
+	INODE_REFERENCE inode_reference;
+} OUFS_DIR_NAME;
+
+// Most entries that a walk can find (every inode, once)
+#define OUFS_WALK_MAX_NODES N_INODES
+
+// Read-only view of a whole file, from oufs_mmap()
+typedef struct oufs_mapping_s
+{
+	// File contents (NULL for an empty file)
+	const unsigned char *data;
+	size_t len;
+
+	// Underlying mapping, released by oufs_munmap()
+	void *base;
+	size_t base_len;
+} OUFS_MAPPING;
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name); // P
 
+// Disk access
+int oufs_disk_open(char *disk_name);
+int oufs_disk_close();
+
 // PROJECT 3
 int oufs_format_disk(char  *virtual_disk_name); // D
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode); // P
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child); // D
+int oufs_resolve_path(char *cwd, char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *name);
 int oufs_mkdir(char *cwd, char *path);
 int oufs_list(char *cwd, char *path);
+int oufs_list_long(char *cwd, char *path);
 int oufs_rmdir(char *cwd, char *path);
 
+// Batched lookups
+int oufs_read_inodes_by_reference(INODE_REFERENCE *refs, int n, INODE *inodes);
+int oufs_stat_many(char *cwd, char **paths, int n, OUFS_STAT *results);
+
+// Subtree counters
+int oufs_update_subtree_counters(BLOCK *master, INODE_REFERENCE dir, int entries, int blocks, int bytes);
+int oufs_compute_subtree_counters(SUBTREE_COUNTER *counters);
+
+// Path index
+int oufs_build_path_index(BLOCK *index);
+
+// Directory Bloom filters
+int oufs_build_bloom_filters(BLOCK *filters);
+
+// Sorted directories
+int oufs_sort_directory(BLOCK *block);
+void oufs_directory_add(BLOCK *block, char *name, INODE_REFERENCE inode_reference);
+int oufs_directory_remove(BLOCK *block, char *name);
+int oufs_directory_dead_slots(BLOCK *block);
+
+// Long names
+int oufs_name_max();
+int oufs_name_entries(int len);
+int oufs_entry_name(BLOCK *block, int i, char *name);
+int oufs_directory_names(BLOCK *block, OUFS_DIR_NAME *names, int sort);
+
+// Tree traversal
+int oufs_walk(char *cwd, char *path, int max_depth, OUFS_WALK_NODE *nodes, int max_nodes);
+int oufs_list_recursive(char *cwd, char *path, int long_format);
+
 // Helper functions in oufs_lib_support.c
 void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BLOCK *block);
 void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry); // P
 BLOCK_REFERENCE oufs_allocate_new_block(); // P
+int oufs_allocate_blocks(BLOCK *master, int n, BLOCK_REFERENCE *refs);
 
 // Helper functions to be provided
 int oufs_find_open_bit(unsigned char value);
 
 // PROJECT 4 ONLY
+#define OUFS_MAX_OPEN_FILES 128
 OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
 void oufs_fclose(OUFILE *fp);
 int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len);
@@ -32,5 +123,34 @@ int oufs_fread(OUFILE *fp, unsigned char * buf, int len);
 int oufs_remove(char *cwd, char *path);
 int oufs_link(char *cwd, char *path_src, char *path_dst);
 
+// Vectored and positional file I/O
+int oufs_freadv(OUFILE *fp, const struct iovec *iov, int iovcnt);
+int oufs_fwritev(OUFILE *fp, const struct iovec *iov, int iovcnt);
+int oufs_preadv(OUFILE *fp, const struct iovec *iov, int iovcnt, int offset);
+int oufs_pwritev(OUFILE *fp, const struct iovec *iov, int iovcnt, int offset);
+int oufs_pread(OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_pwrite(OUFILE *fp, unsigned char *buf, int len, int offset);
+
+// Access pattern hints
+#define OUFS_FADV_NORMAL 0
+#define OUFS_FADV_SEQUENTIAL 1
+#define OUFS_FADV_RANDOM 2
+#define OUFS_FADV_WILLNEED 3
+#define OUFS_FADV_DONTNEED 4
+#define OUFS_FADV_NOREUSE 5
+
+// Blocks in the readahead ring of a sequential reader
+#define OUFS_READAHEAD_BLOCKS 4
+
+int oufs_fadvise(OUFILE *fp, int offset, int len, int advice);
+
+// Zero-copy transfer to a host file descriptor
+int oufs_sendfile(OUFILE *fp, int host_fd, int offset, int len);
+int oufs_import_fd(char *cwd, char *path, int host_fd);
+
+// Memory-mapped files
+int oufs_mmap(OUFILE *fp, OUFS_MAPPING *map);
+void oufs_munmap(OUFS_MAPPING *map);
+
 #endif
 
@@ -1,13 +1,83 @@
 #include <stdlib.h>
 #include "oufs_lib.h"
 
-#include <libgen.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 
 #define debug 0
 
 int oufs_print_bin(char bin);
 
+// Open file table: in-memory inodes shared by every OUFILE on the same file
+typedef struct open_inode_s
+{
+	// Number of OUFILEs referring to this inode (0 = not open)
+	int n_open;
+
+	// Inode has changed since it was last written to the disk
+	int dirty;
+
+	// Directory the file was opened through (for the subtree counters)
+	INODE_REFERENCE parent;
+
+	INODE inode;
+} OPEN_INODE;
+
+static OPEN_INODE open_inode[N_INODES];
+
+// Pool that OUFILEs are handed out from, and the stack of unused ones
+static OUFILE file_pool[OUFS_MAX_OPEN_FILES];
+static OUFILE * free_files[OUFS_MAX_OPEN_FILES];
+static int n_free_files = -1;
+
+// Access pattern state of each OUFILE in the pool (same index)
+typedef struct file_state_s
+{
+	int in_use;
+
+	// OUFS_FADV_* from the last oufs_fadvise() call that set a pattern
+	int advice;
+
+	// Readahead ring used by sequential readers instead of the block cache:
+	//  holds ring_count consecutive file blocks starting at file block ring_start
+	int ring_start;
+	int ring_count;
+	BLOCK ring[OUFS_READAHEAD_BLOCKS];
+} FILE_STATE;
+
+static FILE_STATE file_state[OUFS_MAX_OPEN_FILES];
+
+// Inode of the cwd given by ZPWD_INODE ("<inode>:<generation>")
+#define CWD_HINT_NONE 0
+#define CWD_HINT_UNCHECKED 1
+#define CWD_HINT_VALID 2
+
+typedef struct cwd_hint_s
+{
+	// CWD_HINT_*
+	int state;
+
+	// ZPWD the hint was given for
+	char path[MAX_PATH_LENGTH];
+
+	INODE_REFERENCE inode_reference;
+	unsigned int generation;
+} CWD_HINT;
+
+static CWD_HINT cwd_hint;
+
+// Bloom filters of the directories (FEATURE_BLOOM_FILTERS), loaded once
+//  per open
+#define BLOOM_UNKNOWN 0
+#define BLOOM_NONE 1
+#define BLOOM_LOADED 2
+
+static int bloom_state = BLOOM_UNKNOWN;
+static BLOCK_REFERENCE bloom_block_ref;
+static BLOCK bloom;
+
 /**
  * Read the ZPWD and ZDISK environment variables & copy their values into cwd and disk_name.
  * If these environment variables are not set, then reasonable defaults are given.
@@ -25,6 +95,13 @@ void oufs_get_environment(char *cwd, char *disk_name)
 	} else {
 		// Exists
 		strncpy(cwd, str, MAX_PATH_LENGTH-1);
+
+		// Inode of the cwd, saved by zcd
+		str = getenv("ZPWD_INODE");
+		if(str != NULL && sscanf(str, "%hu:%u", &cwd_hint.inode_reference, &cwd_hint.generation) == 2) {
+			strncpy(cwd_hint.path, cwd, MAX_PATH_LENGTH-1);
+			cwd_hint.state = CWD_HINT_UNCHECKED;
+		}
 	}
 
 	// Virtual disk location
@@ -39,6 +116,122 @@ void oufs_get_environment(char *cwd, char *disk_name)
 
 }
 
+/**
+ * Load all of the metadata into the block cache: the master block, the
+ * inode table and every directory block.  Changes to them are then held
+ * in the cache and written when the disk is closed, so metadata
+ * operations make no requests to the file in between
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_load_metadata()
+{
+	vdisk_cache_write_back(VDISK_WRITE_BACK_METADATA);
+
+	// Master block, inode table and root directory are consecutive
+	if(vdisk_cache_prefetch(MASTER_BLOCK_REFERENCE, ROOT_DIRECTORY_BLOCK + 1) < 0)
+		return(-1);
+
+	// Mark the other directory blocks, the path index and the Bloom filters
+	unsigned char is_directory[N_BLOCKS_IN_DISK] = {0};
+	BLOCK master;
+	if(vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) < 0)
+		return(-1);
+	if(master.master.feature_flags & FEATURE_PATH_INDEX)
+		is_directory[master.master.path_index_block] = 1;
+	if(master.master.feature_flags & FEATURE_BLOOM_FILTERS)
+		is_directory[master.master.bloom_block] = 1;
+	for(int i = 1; i <= N_INODE_BLOCKS; ++i) {
+		BLOCK block;
+		if(vdisk_read_block(i, &block) < 0)
+			return(-1);
+		for(int j = 0; j < INODES_PER_BLOCK; ++j) {
+			INODE *inode = &block.inodes.inode[j];
+			if(inode->type == IT_DIRECTORY && inode->data[0] > ROOT_DIRECTORY_BLOCK
+					&& inode->data[0] < N_BLOCKS_IN_DISK)
+				is_directory[inode->data[0]] = 1;
+		}
+	}
+
+	// Read them a run of consecutive blocks at a time
+	for(int i = ROOT_DIRECTORY_BLOCK + 1; i < N_BLOCKS_IN_DISK; ) {
+		int n = 0;
+		while(i + n < N_BLOCKS_IN_DISK && is_directory[i + n])
+			n++;
+		if(n > 0)
+			vdisk_cache_set_class(i, n, VDISK_CACHE_METADATA);
+
+		// A prefetch reads at most VDISK_CACHE_BLOCKS blocks
+		for(int done = 0; done < n; done += VDISK_CACHE_BLOCKS) {
+			int chunk = n - done < VDISK_CACHE_BLOCKS ? n - done : VDISK_CACHE_BLOCKS;
+			if(vdisk_cache_prefetch(i + done, chunk) < 0)
+				return(-1);
+		}
+		i += n + 1;
+	}
+
+	return(0);
+}
+
+/**
+ * Open the virtual disk that holds the file system, and tell the block
+ * cache which blocks are metadata: the master block, the inode table and
+ * the root directory are kept apart from file data.  The cache is warmed
+ * from the hot-block list in <disk_name>.hot, which a process that
+ * committed changes rewrites at close.
+ *
+ * If ZMETADATA is set to "memory", all of the metadata is loaded now and
+ * changes to it are written at close (oufs_load_metadata()).
+ *
+ * Changes are committed atomically (vdisk_cache_atomic()): writes to
+ * every block are held in the block cache and go to a copy of the disk
+ * that replaces it at close, so other processes read a consistent
+ * snapshot while a writer works.  If ZWRITE is set to "batch", the held
+ * writes go to the disk itself instead, in sorted batches: when the cache
+ * has to give up a changed block, and at close.  If it is set to
+ * "inplace", every write goes straight to the disk
+ *
+ * @param disk_name File name of the virtual disk
+ * @return 0 on success; <0 on error
+ */
+int oufs_disk_open(char *disk_name)
+{
+	if(vdisk_disk_open(disk_name) != 0)
+		return(-1);
+
+	vdisk_cache_set_class(MASTER_BLOCK_REFERENCE, 1, VDISK_CACHE_METADATA);
+	vdisk_cache_set_class(1, N_INODE_BLOCKS, VDISK_CACHE_METADATA);
+	vdisk_cache_set_class(ROOT_DIRECTORY_BLOCK, 1, VDISK_CACHE_METADATA);
+	bloom_state = BLOOM_UNKNOWN;
+
+	// Start with the blocks the last process used most
+	char list_name[MAX_PATH_LENGTH + 8];
+	snprintf(list_name, sizeof(list_name), "%s.hot", disk_name);
+	vdisk_cache_warm(list_name);
+
+	int ret = 0;
+	char *mode = getenv("ZMETADATA");
+	if(mode != NULL && !strcmp(mode, "memory"))
+		ret = oufs_load_metadata();
+
+	mode = getenv("ZWRITE");
+	if(ret < 0 || (mode != NULL && !strcmp(mode, "inplace")))
+		return(ret);
+	if(mode != NULL && !strcmp(mode, "batch"))
+		return(vdisk_cache_write_back(VDISK_WRITE_BACK_ALL));
+	return(vdisk_cache_atomic(1));
+}
+
+/**
+ * Close the virtual disk opened by oufs_disk_open()
+ *
+ * @return 0 on success; <0 on error
+ */
+int oufs_disk_close()
+{
+	return(vdisk_disk_close());
+}
+
 /**
  * Configure a directory entry so that it has no name and no inode
  *
@@ -163,6 +356,12 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
 	if(debug)
 		fprintf(stderr, "Fetching inode %d\n", i);
 
+	// Open files have the current copy in memory
+	if (i < N_INODES && open_inode[i].n_open > 0) {
+		*inode = open_inode[i].inode;
+		return(0);
+	}
+
 	// Find the address of the inode block and the inode within the block
 	BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
 	int element = (i % INODES_PER_BLOCK);
@@ -204,6 +403,16 @@ int oufs_format_disk(char * virtual_disk_name){
 	}
 	block.master.block_allocated_flag[0] = 255;
 	block.master.block_allocated_flag[1] = 3;
+
+	// New disks keep their directories sorted, and allow long names
+	block.master.feature_flags = FEATURE_SORTED_DIRECTORIES | FEATURE_LONG_NAMES;
+
+	// A new disk must not accept inode references saved for an old one,
+	//  even one formatted in the same second
+	unsigned int seed = 0;
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+		seed = (unsigned int) getpid() << 16;
+	block.master.namespace_generation = (unsigned int) time(NULL) ^ seed;
 	if (vdisk_write_block(0, &block) < 0) return -1;
 
 	// Format inode[0]
@@ -284,292 +493,949 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE * inode){
 	// Write inode to disk
 	if (vdisk_write_block(block_no, &block) == -1) return -1;
 
+	// Keep the open file table in step
+	if (i < N_INODES && open_inode[i].n_open > 0) {
+		open_inode[i].inode = *inode;
+		open_inode[i].dirty = 0;
+	}
+
 	return 0;
 }
 
 /**
- * Given an inode, directory name, and pointer to an inode reference, search
- * to see if the given directory name exists in the directory block pointed
- * to by the inode. If so, fill the value pointed to by inode_reference.
+ * Check whether the inode given by ZPWD_INODE can be used for cwd: it
+ * must have been given for the same path, on a disk whose namespace has
+ * not changed since, and still be a directory
  *
- * @param inode Inode to search
- * @param name String to search for in directory block pointed to by inode
- * @param inode_reference Pointer to populate if proper name is located
+ * @param cwd Current working directory
+ * @param inode_reference Set to the inode of cwd if the hint is valid
  *
- */ 
-int oufs_find_inode_ref_by_name (INODE inode, char * name, INODE_REFERENCE * inode_reference) {
-
-	BLOCK block;
-
-	// Read directory block
-	if (vdisk_read_block(inode.data[0], &block) == -1)
-		return -1;
+ * @return 1 The hint is valid
+ *         0 No valid hint
+ */
+static int oufs_cwd_hint(char *cwd, INODE_REFERENCE *inode_reference)
+{
+	if (cwd_hint.state == CWD_HINT_NONE || strcmp(cwd, cwd_hint.path))
+		return 0;
 
+	if (cwd_hint.state == CWD_HINT_UNCHECKED) {
+		BLOCK master;
+		INODE inode;
+		cwd_hint.state = CWD_HINT_NONE;
+		if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) == 0
+				&& master.master.namespace_generation == cwd_hint.generation
+				&& cwd_hint.inode_reference < N_INODES
+				&& oufs_read_inode_by_reference(cwd_hint.inode_reference, &inode) == 0
+				&& inode.type == IT_DIRECTORY)
+			cwd_hint.state = CWD_HINT_VALID;
+	}
 
-	// Loop through directory entries
-	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+	if (cwd_hint.state != CWD_HINT_VALID)
+		return 0;
+	*inode_reference = cwd_hint.inode_reference;
+	return 1;
+}
 
-		// If we find a matching directory entry...
-		if (!strcmp(block.directory.entry[i].name, name)){
+/**
+ * Bloom filter bits for a name: two of the 32 bits of a directory's filter
+ *
+ * @param name Name (need not be terminated)
+ * @param len Length of the name
+ *
+ * @return Mask with the name's bits set
+ */
+static unsigned int oufs_bloom_mask(const char *name, int len)
+{
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	return (1u << (hash & 31)) | (1u << ((hash >> 5) & 31));
+}
 
-			// Make note of the entry's inode reference and break out of the loop
-			*inode_reference = block.directory.entry[i].inode_reference;
-			return 1;
+/**
+ * Load the Bloom filters of the disk into bloom, once per open
+ *
+ * @return 1 The disk has Bloom filters
+ *         0 It does not
+ *       < 0 Error
+ */
+static int oufs_bloom_load()
+{
+	if (bloom_state == BLOOM_UNKNOWN) {
+		BLOCK master;
+		if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) < 0) return -1;
+		bloom_state = BLOOM_NONE;
+		if (master.master.feature_flags & FEATURE_BLOOM_FILTERS) {
+			bloom_block_ref = master.master.bloom_block;
+			vdisk_cache_set_class(bloom_block_ref, 1, VDISK_CACHE_METADATA);
+			if (vdisk_read_block(bloom_block_ref, &bloom) < 0) return -1;
+			bloom_state = BLOOM_LOADED;
 		}
 	}
 
-	// No match was found
-	return 0;
+	return bloom_state == BLOOM_LOADED;
 }
 
 /**
- * Given a cwd and path, tokenize both inputs and walk their inodes to the end
- * of path. Return the child inode located at the end of the path and it's parent.
- *
- * @param cwd Current working directory
- * @param path Path to search for
- * @param parent Pointer to inode reference of parent which will be modified if found
- * @param child Pointer to inode reference of child which will be modified if found
+ * Could a directory hold a name?  "." and ".." are not in the filters
  *
- * @return 0 
- *       < 0 
+ * @param dir Inode reference of the directory
+ * @param name Name (need not be terminated)
+ * @param len Length of the name
  *
+ * @return 0 The name is certainly not in the directory
+ *         1 It may be
  */
-int oufs_find_file (char * cwd, char * path, INODE_REFERENCE * parent, INODE_REFERENCE * child) {
+static int oufs_bloom_may_contain(INODE_REFERENCE dir, const char *name, int len)
+{
+	if (dir >= N_INODES || oufs_bloom_load() <= 0) return 1;
 
-	// Start the cwd inode reference at zero since it will always start at root
-	INODE_REFERENCE cwd_inode_ref = 0;
-	INODE_REFERENCE path_inode_ref;
+	unsigned int mask = oufs_bloom_mask(name, len);
+	return (bloom.bloom.filter[dir] & mask) == mask;
+}
 
-	// If the given path is '/', set both parent and child to 0 since this is root
-	if (!strcmp(path, "/")) {
-		parent = child = 0;
-		return 0;
-	}
+/**
+ * Update the Bloom filter of a directory, if the disk has them
+ *
+ * @param dir Inode reference of the directory
+ * @param name Name added to the directory; NULL to empty the filter
+ *
+ * @return 0 on success; < 0 on error
+ */
+static int oufs_bloom_update(INODE_REFERENCE dir, char *name)
+{
+	int ret = oufs_bloom_load();
+	if (ret <= 0 || dir >= N_INODES) return ret;
+
+	if (name == NULL)
+		bloom.bloom.filter[dir] = 0;
+	else
+		bloom.bloom.filter[dir] |= oufs_bloom_mask(name, strlen(name));
+	return vdisk_write_block(bloom_block_ref, &bloom);
+}
 
-	if (strcmp(cwd, "/")) { // If the cwd is not the home directory
-
-		// Since cwd is not the home directory, we need to tokenize the path and get its inode
-		char ** cwd_ptr;
-		char * cwd_tok[MAX_PATH_LENGTH];                     
-		char cwd_buf[MAX_PATH_LENGTH];                      
-		strncpy(cwd_buf, cwd, MAX_PATH_LENGTH);
-		cwd_ptr = cwd_tok;
-		*cwd_ptr++ = strtok(cwd_buf,"/");   
-		while ((*cwd_ptr++ = strtok(NULL,"/")));
-		cwd_ptr = cwd_tok;
-
-		INODE cwd_inode;
-
-		// Infinite loop until end of path walk (undetermined length)
-		for (;;) {
-
-			// Load new inode
-			memset(&cwd_inode, 0, sizeof(cwd_inode));
-			oufs_read_inode_by_reference(cwd_inode_ref, &cwd_inode);
-
-			if (oufs_find_inode_ref_by_name (cwd_inode, *cwd_ptr, &cwd_inode_ref)) {
-				// If there is an inode found
-				*parent = *child; // Assign the parent the the child's previous inode ref
-				*child = cwd_inode_ref; // Assign the child to the newly found inode ref
-				cwd_ptr = cwd_ptr + 1; // Move to the next token
-				if (!*cwd_ptr) {
-					// Valid cwd path
-					path_inode_ref = cwd_inode_ref;
-					break;
-				}
-			} else {
-				// If no inode is found, the cwd is currupt
-				fprintf(stderr, "Invalid cwd %s\n", cwd);
-				return -1;
-			}
-		}
-	}
+/**
+ * May names take more than one directory entry on this disk
+ * (FEATURE_LONG_NAMES)?
+ *
+ * @return 1 if they may; 0 if not
+ */
+static int oufs_long_names()
+{
+	BLOCK master;
+	if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) < 0) return 0;
+	return (master.master.feature_flags & FEATURE_LONG_NAMES) != 0;
+}
 
+/**
+ * Longest name that can be given to a new file or directory on this disk
+ *
+ * @return Number of characters
+ */
+int oufs_name_max()
+{
+	return oufs_long_names() ? LONG_NAME_SIZE - 1 : FILE_NAME_SIZE - 1;
+}
 
-	// Since the cwd inode was properly found, tokenize path
-	char path_buf[MAX_PATH_LENGTH];                      
-	char * path_tok[MAX_PATH_LENGTH];                   
-	char ** path_ptr;
-	strncpy(path_buf, path, MAX_PATH_LENGTH);
-	path_ptr = path_tok;
-	*path_ptr++ = strtok(path_buf,"/");   
-	while ((*path_ptr++ = strtok(NULL,"/")));
-	path_ptr = path_tok;
+/**
+ * Number of directory entries that a name takes
+ *
+ * @param len Length of the name
+ *
+ * @return Number of entries
+ */
+int oufs_name_entries(int len)
+{
+	return len < FILE_NAME_SIZE ? 1 : (len + FILE_NAME_SIZE - 1) / FILE_NAME_SIZE;
+}
 
-	INODE path_inode;
+/**
+ * Read the name held by a directory entry and the continuation entries
+ * after it
+ *
+ * @param block Directory block
+ * @param i Slot of the entry
+ * @param name Set to the name (LONG_NAME_SIZE bytes)
+ *
+ * @return Number of entries the name takes; 0 if the slot is free or
+ *         continues an earlier name
+ */
+int oufs_entry_name(BLOCK *block, int i, char *name)
+{
+	DIRECTORY_ENTRY *entry = block->directory.entry;
+	if (entry[i].inode_reference == UNALLOCATED_INODE || entry[i].inode_reference == CONTINUATION_INODE) return 0;
+
+	int n = 0;
+	do {
+		memcpy(name + n * FILE_NAME_SIZE, entry[i + n].name, FILE_NAME_SIZE);
+		n++;
+	} while (n < LONG_NAME_ENTRIES && i + n < DIRECTORY_ENTRIES_PER_BLOCK
+			&& entry[i + n].inode_reference == CONTINUATION_INODE);
+	name[n * FILE_NAME_SIZE] = 0;
+	return n;
+}
 
-	// Infinite loop until end of path walk (undetermined length)
-	for (;;) {
+/**
+ * Store a name and its inode in a directory block, the rest of a long
+ * name going into continuation entries
+ *
+ * @param block Directory block
+ * @param i First slot to use; there must be oufs_name_entries() free
+ *        slots from here on
+ * @param name Name
+ * @param inode_reference Inode the name refers to
+ *
+ * @return Number of entries used
+ */
+static int oufs_entry_store(BLOCK *block, int i, const char *name, INODE_REFERENCE inode_reference)
+{
+	int len = strlen(name);
+	int n = oufs_name_entries(len);
+	for (int k = 0; k < n; k++) {
+		DIRECTORY_ENTRY *entry = &block->directory.entry[i + k];
+		memset(entry->name, 0, FILE_NAME_SIZE);
+		memcpy(entry->name, name + k * FILE_NAME_SIZE, MIN(FILE_NAME_SIZE, len - k * FILE_NAME_SIZE));
+		entry->inode_reference = k == 0 ? inode_reference : CONTINUATION_INODE;
+	}
+	return n;
+}
 
-		// Load new inode
-		memset(&path_inode, 0, sizeof(path_inode));
-		oufs_read_inode_by_reference(path_inode_ref, &path_inode);
-
-		if (oufs_find_inode_ref_by_name (path_inode, *path_ptr, &path_inode_ref)) {
-			// Match found at current inode
-			*parent = *child;
-			*child = path_inode_ref;
-			path_ptr = path_ptr + 1; // Move to the next token
-			if (!*path_ptr) {
-				// Name found
-				return 1;
-			}
-		} else {
-			// Inode not found, increment pointer and see if this is an error 
-			path_ptr = path_ptr + 1;
-			if (!*path_ptr) {
-				// No big deal, name was simply not found
-				return 0;
-			} else {
-				// Invalid path
-				fprintf(stderr, "Improper path name %s\n", path);
-				return -1;
-			}
-		}
+/**
+ * Recompute the Bloom filter of a directory from its block, dropping the
+ * bits of names that have been removed
+ *
+ * @param dir Inode reference of the directory
+ * @param block Directory block of dir
+ *
+ * @return 0 on success; < 0 on error
+ */
+static int oufs_bloom_rebuild(INODE_REFERENCE dir, BLOCK *block)
+{
+	int ret = oufs_bloom_load();
+	if (ret <= 0 || dir >= N_INODES) return ret;
 
+	unsigned int filter = 0;
+	char name[LONG_NAME_SIZE];
+	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+		if (oufs_entry_name(block, i, name) > 0 && strcmp(name, ".") && strcmp(name, ".."))
+			filter |= oufs_bloom_mask(name, strlen(name));
 	}
+	if (filter == bloom.bloom.filter[dir]) return 0;
 
-	// This should not be reached
-	return -1;
+	bloom.bloom.filter[dir] = filter;
+	return vdisk_write_block(bloom_block_ref, &bloom);
 }
 
 /**
- * Given a byte (char) and a position in the byte (pos), flip
- * the pos position in the character using a binary mask.
- *
- * @param byte Pointer to byte to modify
- * @param pos Position of bit to flip
+ * Build the Bloom filters of every directory on the disk
  *
- * @return 0 Success
+ * @param filters Block to fill in
  *
+ * @return 0 on success; < 0 on error
  */
-int oufs_flip_bit(char * byte, int pos) {
+int oufs_build_bloom_filters(BLOCK *filters) {
 
-	// Build binary mask using position
-	int mask = 1 << pos;
+	OUFS_WALK_NODE nodes[OUFS_WALK_MAX_NODES];
+	int n_nodes = oufs_walk("/", "/", -1, nodes, OUFS_WALK_MAX_NODES);
+	if (n_nodes < 0) return -1;
 
-	// Mask current byte to flip bit
-	*byte ^= mask;
+	memset(filters, 0, sizeof(BLOCK));
+	for (int i = 1; i < n_nodes; i++) {
+		char * name = strrchr(nodes[i].path, '/') + 1;
+		filters->bloom.filter[nodes[nodes[i].parent].inode_reference] |= oufs_bloom_mask(name, strlen(name));
+	}
 
 	return 0;
 }
 
 /**
- * Given a byte, search for an available position in the byte
- * that is currently a binary 0.
+ * Are directory blocks kept sorted on this disk (FEATURE_SORTED_DIRECTORIES)?
  *
- * @param byte Byte to search
- * @param pos Pointer to position of available bit
+ * @return 1 if they are; 0 if not
+ */
+static int oufs_directories_sorted()
+{
+	BLOCK master;
+	if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) < 0) return 0;
+	return (master.master.feature_flags & FEATURE_SORTED_DIRECTORIES) != 0;
+}
+
+/**
+ * Compare a directory entry's name with a name given by a pointer and a
+ * length, in the order of oufs_comparator()
  *
- * @return 1 Position found
- * 	   0 No position available (i.e. byte_2 = 1111 1111)
+ * @param entry_name Name in the entry
+ * @param name Name (need not be terminated; shorter than LONG_NAME_SIZE)
+ * @param len Length of the name
  *
+ * @return < 0, 0 or > 0 as the entry sorts before, with or after the name
  */
-int oufs_find_available_bit(char byte, int * pos) {
-
-	for (int i = 0; i < 8; i++){
-		if (((byte >> i) & 0x01) == 0){
-			*pos = i;
-			// Return 1 if position is found
-			return 1;
-		}
-	}
-
-	// Return 0 if nothing is found
-	return 0;
+static int oufs_entry_compare(const char *entry_name, const char *name, int len)
+{
+	int cmp = strncmp(entry_name, name, len);
+	if (cmp != 0) return cmp;
+	return entry_name[len] != 0;
 }
 
-/** 
- * Given an array of bytes (chars) and a type, search each byte in the
- * array for an available posision. When an available posision is found,
- * modify the pos pointer to indicate which block posision was chosen.
- *
- * @param byte_array Array of characters to search for avaiable position
- * @param pos Pointer to integer which will indicate which block was chosen
- * @param type 'I' = Array is inode table, 'B' = Array is block table
+/**
+ * Find a name in a directory.  The name is given by a pointer and a
+ * length, so it can be looked up straight out of a path
  *
- * @return 0 Successfully modified byte_array and found position
- * 	 < 0 Error processing byte array or unable to find position
+ * @param dir Inode reference of the directory
+ * @param name Name to look for (need not be terminated)
+ * @param len Length of the name
+ * @param inode_reference Set to the entry's inode if it is found
  *
+ * @return 1 Found
+ *         0 Not found, or dir is not a directory
+ *       < 0 Error
  */
-int oufs_find_bit_positions(unsigned char * byte_array, int * pos, char type) {
+static int oufs_lookup_component(INODE_REFERENCE dir, const char *name, int len, INODE_REFERENCE *inode_reference)
+{
+	// Most misses are answered by the directory's Bloom filter
+	int dots = (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.');
+	if (!dots && !oufs_bloom_may_contain(dir, name, len)) return 0;
 
-	// Determine type of array
-	int size = 0;
-	if (type == 'I') { // inode table
-		size = (N_INODES >> 3);
-	} else if (type == 'B') { // block table
-		size = (N_BLOCKS_IN_DISK >> 3);
-	} else {
-		fprintf(stderr, "oufs_find_bit_positions(): Unknown type\n");
-		return -1;
-	}
+	if (len >= LONG_NAME_SIZE) return 0;
 
-	// Loop through each character in the char array
-	int byte, bit;
-	for (int i = 0; i < size; i++) {
+	INODE inode;
+	if (oufs_read_inode_by_reference(dir, &inode) < 0) return -1;
+	if (inode.type != IT_DIRECTORY) return 0;
 
-		// Determine if a bit is available in the current row
-		if (oufs_find_available_bit(byte_array[i], &bit)) {
-			// Position is found, break loop
-			byte = i;
-			break;
-		} else {
-			// If no position was found in the current row, check to see if
-			// this is the last row. If so, there is no more room available.
-			if (i == size - 1) {
-				if (type == 'I') fprintf(stderr, "Not enough available inodes to make directory\n");
-				if (type == 'B') fprintf(stderr, "Not enough available blocks to make directory\n");
-				return -1;
+	BLOCK block;
+	if (vdisk_read_block(inode.data[0], &block) < 0) return -1;
+	char entry_name[LONG_NAME_SIZE];
+
+	// Sorted: binary search of the allocated entries after . and .., which
+	//  stay in slots 0 and 1 (and are found by the scan below).  low
+	//  always starts a name; a probe that lands on a continuation steps
+	//  back to the entry it continues
+	if (!dots && oufs_directories_sorted()) {
+		int low = 2, high = MIN(inode.size, DIRECTORY_ENTRIES_PER_BLOCK) - 1;
+		while (low <= high) {
+			int mid = (low + high) / 2;
+			while (mid > low && block.directory.entry[mid].inode_reference == CONTINUATION_INODE)
+				mid--;
+			int n = oufs_entry_name(&block, mid, entry_name);
+			if (n == 0) return 0;
+			int cmp = oufs_entry_compare(entry_name, name, len);
+			if (cmp == 0) {
+				*inode_reference = block.directory.entry[mid].inode_reference;
+				return 1;
 			}
+			if (cmp < 0)
+				low = mid + n;
+			else
+				high = mid - 1;
 		}
+		return 0;
 	}
 
-	// Flip proper bytes in char array
-	char new_byte = byte_array[byte];
-	oufs_flip_bit(&new_byte, bit);
-	byte_array[byte] = new_byte;
-
-	// Calculate the position of the block
-	*pos = 8 * byte + bit;
+	// Stop after the last allocated entry, so dead slots behind it cost nothing
+	int live = 0;
+	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK && live < inode.size; i++) {
+		int n = oufs_entry_name(&block, i, entry_name);
+		if (n == 0) continue;
+		live += n;
+		if (!oufs_entry_compare(entry_name, name, len)) {
+			*inode_reference = block.directory.entry[i].inode_reference;
+			return 1;
+		}
+	}
 
 	return 0;
 }
 
 /**
- * Given a cwd and a path, make a directory path at cwd.
+ * Extend the hash of a path by one component.  Paths are hashed as
+ * "/name/name...", so the hash of a path is that of its parent extended
+ * by its last component (32-bit FNV-1a)
  *
- * @param cwd Pointer to current working directory path
- * @param path Pointer to path to create
+ * @param hash Hash of the parent path (PATH_HASH_ROOT for the root)
+ * @param name Component (need not be terminated)
+ * @param len Length of the component
  *
- * @return 0 Successfully created directory
- * 	 < 0 Error making directory
+ * @return Hash of the longer path
+ */
+static unsigned int oufs_path_hash(unsigned int hash, const char *name, int len)
+{
+	hash = (hash ^ '/') * 16777619u;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	return hash;
+}
+
+/**
+ * Key under which a path is stored in the path index
  *
+ * @param hash Full path hash from oufs_path_hash()
+ *
+ * @return Stored key
  */
-int oufs_mkdir(char * cwd, char * path){
+static unsigned short oufs_path_index_key(unsigned int hash)
+{
+	return (unsigned short) (hash ^ (hash >> 16));
+}
 
-	// Get inode references from search. The 'parent' inode is useless
-	// in this function, which is why its being labelled the grandparent.
-	// The child is effectivly the parent when making a new directory.
-	INODE_REFERENCE gparent_inode_ref, parent_inode_ref;
+/**
+ * Read the path index, if the disk has one
+ *
+ * @param master Set to the master block
+ * @param index Set to the index block
+ *
+ * @return 1 The disk has a path index
+ *         0 It does not
+ *       < 0 Error
+ */
+static int oufs_path_index_read(BLOCK *master, BLOCK *index)
+{
+	if (vdisk_read_block(MASTER_BLOCK_REFERENCE, master) < 0) return -1;
+	if (!(master->master.feature_flags & FEATURE_PATH_INDEX)) return 0;
 
-	// Search to see if path already exists in cwd
-	int find_file = oufs_find_file (cwd, path, &gparent_inode_ref, &parent_inode_ref);
+	BLOCK_REFERENCE block_ref = master->master.path_index_block;
+	vdisk_cache_set_class(block_ref, 1, VDISK_CACHE_METADATA);
+	if (vdisk_read_block(block_ref, index) < 0) return -1;
+	return 1;
+}
 
-	if (find_file == 0) { // Make directory
+/**
+ * Add a directory to a path index block
+ *
+ * @param index Index block
+ * @param key Key of the directory's path
+ * @param inode_reference Inode of the directory
+ * @param parent Inode of its parent
+ */
+static void oufs_path_index_add(BLOCK *index, unsigned short key, INODE_REFERENCE inode_reference, INODE_REFERENCE parent)
+{
+	// Linear probing; there are more slots than directories
+	for (int n = 0, i = key % PATH_INDEX_SLOTS; n < PATH_INDEX_SLOTS; n++, i = (i + 1) % PATH_INDEX_SLOTS) {
+		PATH_INDEX_ENTRY *entry = &index->path_index.entry[i];
+		if (entry->inode_reference == 0) {
+			entry->hash = key;
+			entry->inode_reference = inode_reference;
+			entry->parent = parent;
+			return;
+		}
+	}
+}
+
+/**
+ * Record a new directory in the path index, if the disk has one
+ *
+ * @param hash Full path hash of the directory
+ * @param inode_reference Inode of the directory
+ * @param parent Inode of its parent
+ *
+ * @return 0 on success; < 0 on error
+ */
+static int oufs_path_index_insert(unsigned int hash, INODE_REFERENCE inode_reference, INODE_REFERENCE parent)
+{
+	BLOCK master, index;
+	int ret = oufs_path_index_read(&master, &index);
+	if (ret <= 0) return ret;
+
+	oufs_path_index_add(&index, oufs_path_index_key(hash), inode_reference, parent);
+	return vdisk_write_block(master.master.path_index_block, &index);
+}
+
+/**
+ * Remove a directory from the path index, if the disk has one
+ *
+ * @param inode_reference Inode of the directory
+ *
+ * @return 0 on success; < 0 on error
+ */
+static int oufs_path_index_remove(INODE_REFERENCE inode_reference)
+{
+	BLOCK master, index;
+	int ret = oufs_path_index_read(&master, &index);
+	if (ret <= 0) return ret;
+
+	PATH_INDEX_ENTRY *entry = index.path_index.entry;
+	int i = 0;
+	while (i < PATH_INDEX_SLOTS && entry[i].inode_reference != inode_reference)
+		i++;
+	if (i == PATH_INDEX_SLOTS) return 0;
+
+	// Empty the slot, then add back the rest of its probe run so that none
+	//  of them is cut off from its home slot
+	entry[i].inode_reference = 0;
+	for (int j = (i + 1) % PATH_INDEX_SLOTS; entry[j].inode_reference != 0; j = (j + 1) % PATH_INDEX_SLOTS) {
+		PATH_INDEX_ENTRY moved = entry[j];
+		entry[j].inode_reference = 0;
+		oufs_path_index_add(&index, moved.hash, moved.inode_reference, moved.parent);
+	}
+
+	return vdisk_write_block(master.master.path_index_block, &index);
+}
+
+/**
+ * Build a path index block for every directory on the disk
+ *
+ * @param index Block to fill in
+ *
+ * @return 0 on success; < 0 on error
+ */
+int oufs_build_path_index(BLOCK *index) {
+
+	OUFS_WALK_NODE nodes[OUFS_WALK_MAX_NODES];
+	int n_nodes = oufs_walk("/", "/", -1, nodes, OUFS_WALK_MAX_NODES);
+	if (n_nodes < 0) return -1;
+
+	// Parents come before their children, so each hash extends one
+	//  already computed
+	unsigned int hash[n_nodes];
+	hash[0] = PATH_HASH_ROOT;
+	memset(index, 0, sizeof(BLOCK));
+	for (int i = 1; i < n_nodes; i++) {
+		if (nodes[i].inode.type != IT_DIRECTORY) continue;
+		char * name = strrchr(nodes[i].path, '/') + 1;
+		hash[i] = oufs_path_hash(hash[nodes[i].parent], name, strlen(name));
+		oufs_path_index_add(index, oufs_path_index_key(hash[i]), nodes[i].inode_reference, nodes[nodes[i].parent].inode_reference);
+	}
+
+	return 0;
+}
+
+/**
+ * Check that the path index places a directory at a given depth of a
+ * path: following parents up from the directory, the index entry at each
+ * depth must carry the key of the path up to that depth, ending at the
+ * root
+ *
+ * @param index Path index block
+ * @param hash Hash of the path up to each component
+ * @param depth Depth of the directory in the path
+ * @param dir Inode reference of the directory
+ *
+ * @return 1 if the index agrees; 0 if not
+ */
+static int oufs_path_index_chain(BLOCK *index, unsigned int *hash, int depth, INODE_REFERENCE dir)
+{
+	for (int d = depth; d > 0; d--) {
+		unsigned short key = oufs_path_index_key(hash[d]);
+		PATH_INDEX_ENTRY *entry = NULL;
+		for (int n = 0, i = key % PATH_INDEX_SLOTS; n < PATH_INDEX_SLOTS; n++, i = (i + 1) % PATH_INDEX_SLOTS) {
+			if (index->path_index.entry[i].inode_reference == 0) break;
+			if (index->path_index.entry[i].inode_reference == dir && index->path_index.entry[i].hash == key) {
+				entry = &index->path_index.entry[i];
+				break;
+			}
+		}
+		if (entry == NULL) return 0;
+		dir = entry->parent;
+	}
+
+	return dir == 0;
+}
+
+/**
+ * Find the deepest directory of a path that is in the path index.  A
+ * match is only taken once its parent's directory block confirms the
+ * last name, and the index entries of its parent and each directory
+ * above it carry the keys of the matching shorter paths.  A key shared
+ * by two paths therefore only matters if every level collides too; a
+ * stale or colliding entry just means a longer walk
+ *
+ * @param component Components of the path, from the root
+ * @param length Their lengths
+ * @param hash Hash of the path up to each component
+ * @param depth Number of components
+ * @param inode_reference Set to the inode of the directory found
+ * @param parent Set to the inode of its parent
+ *
+ * @return Number of components matched (0 if none)
+ */
+static int oufs_path_index_probe(const char **component, int *length, unsigned int *hash, int depth,
+		INODE_REFERENCE *inode_reference, INODE_REFERENCE *parent)
+{
+	BLOCK master, index;
+	if (depth == 0 || oufs_path_index_read(&master, &index) <= 0) return 0;
+
+	for (int d = depth; d > 0; d--) {
+		unsigned short key = oufs_path_index_key(hash[d]);
+		for (int n = 0, i = key % PATH_INDEX_SLOTS; n < PATH_INDEX_SLOTS; n++, i = (i + 1) % PATH_INDEX_SLOTS) {
+			PATH_INDEX_ENTRY *entry = &index.path_index.entry[i];
+			if (entry->inode_reference == 0) break;
+
+			INODE_REFERENCE found;
+			if (entry->hash == key
+					&& oufs_lookup_component(entry->parent, component[d], length[d], &found) == 1
+					&& found == entry->inode_reference
+					&& oufs_path_index_chain(&index, hash, d - 1, entry->parent)) {
+				*inode_reference = entry->inode_reference;
+				*parent = entry->parent;
+				return d;
+			}
+		}
+	}
+
+	return 0;
+}
 
-		// Get name of directory from path
-		char dir_name[FILE_NAME_SIZE];
-		char temp[MAX_PATH_LENGTH];
-		strcpy(temp, path);
-		char * basename_ptr = basename(temp);
-		if (strlen(basename_ptr) > FILE_NAME_SIZE) {
-			fprintf(stderr, "Directory name too large\n");
+/**
+ * Resolve a path.  The components of cwd (for a relative path) and then
+ * of path are first reduced lexically, in place and without copying
+ * either string: "." is skipped and ".." drops the component before it
+ * (".." at the root stays at the root).  This is safe since directories
+ * cannot be linked from more than one place, once the components that
+ * ".." drops are known to exist and to be directories: those are looked
+ * up before they are dropped, and the walk later starts no higher than
+ * the deepest of them still in the path.
+ *
+ * The walk then starts as deep as it can: at the deepest directory found
+ * in the path index, or else at the cwd if ZPWD_INODE gives a valid
+ * inode for it, or else at the root.
+ *
+ * On return child is the inode at the end of the path, and parent is
+ * the directory holding it.  If only the last component is missing,
+ * child is the directory it would be created in and parent is that
+ * directory's parent; it is an error if what comes before the last
+ * component is not a directory.
+ *
+ * @param cwd Current working directory
+ * @param path Path to resolve
+ * @param parent Set to the parent inode reference
+ * @param child Set to the child inode reference
+ * @param name If not NULL, set to the last component of path (LONG_NAME_SIZE
+ *        bytes; "" if path has no components)
+ * @param path_hash If not NULL, set to the hash of the resolved path
+ *
+ * @return 1 The path exists
+ *         0 Only the last component does not exist
+ *       < 0 Error
+ */
+static int oufs_resolve(char *cwd, char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *name,
+		unsigned int *path_hash)
+{
+	// The path reduced to components from the root.  No path to anything
+	//  can be deeper than the number of inodes
+	const char *component[N_INODES + 1];
+	int length[N_INODES + 1];
+	unsigned int hash[N_INODES + 1];
+	int depth = 0;
+	hash[0] = PATH_HASH_ROOT;
+
+	// Depth of cwd, and the lowest depth path then backs up to
+	int cwd_depth = 0;
+	int low = 0;
+
+	// Does path end with a name (rather than nothing, "." or "..")?
+	int ends_with_name = 0;
+
+	// Inodes of the components found so far: chain[0] ... chain[n_known]
+	INODE_REFERENCE chain[N_INODES + 1];
+	chain[0] = 0;
+	int n_known = 0;
+
+	if (name != NULL)
+		name[0] = 0;
+
+	char *walk[2] = {cwd, path};
+	for (int w = path[0] == '/' ? 1 : 0; w < 2; w++) {
+		const char *p = walk[w];
+		if (w == 1)
+			cwd_depth = low = depth;
+
+		while (*p) {
+			// Next component
+			while (*p == '/')
+				p++;
+			if (!*p)
+				break;
+			const char *start = p;
+			while (*p && *p != '/')
+				p++;
+			int len = p - start;
+
+			// Is this the last component of path?
+			const char *rest = p;
+			while (*rest == '/')
+				rest++;
+			if (w == 1 && !*rest) {
+				if (name != NULL) {
+					if (len > oufs_name_max()) {
+						fprintf(stderr, "Name too large in %s\n", path);
+						return -1;
+					}
+					memcpy(name, start, len);
+					name[len] = 0;
+				}
+				ends_with_name = !(len == 1 && start[0] == '.') && !(len == 2 && start[0] == '.' && start[1] == '.');
+			}
+
+			if (len == 1 && start[0] == '.')
+				continue;
+			if (len == 2 && start[0] == '.' && start[1] == '.') {
+				if (depth > 0) {
+					// The component dropped must be a directory, as must
+					//  everything before it
+					for (int d = n_known + 1; d <= depth; d++) {
+						INODE inode;
+						int ret = oufs_lookup_component(chain[d - 1], component[d], length[d], &chain[d]);
+						if (ret > 0 && d == depth)
+							ret = oufs_read_inode_by_reference(chain[d], &inode) < 0 ? -1 : inode.type == IT_DIRECTORY;
+						if (ret < 0)
+							return -1;
+						if (ret == 0) {
+							if (w == 0 || d <= low)
+								fprintf(stderr, "Invalid cwd %s\n", cwd);
+							else
+								fprintf(stderr, "Improper path name %s\n", path);
+							return -1;
+						}
+					}
+					depth--;
+					n_known = depth;
+				}
+				if (depth < low)
+					low = depth;
+				continue;
+			}
+
+			if (depth == N_INODES) {
+				fprintf(stderr, "Improper path name %s\n", path);
+				return -1;
+			}
+			depth++;
+			component[depth] = start;
+			length[depth] = len;
+			hash[depth] = oufs_path_hash(hash[depth - 1], start, len);
+		}
+	}
+
+	if (path_hash != NULL)
+		*path_hash = hash[depth];
+
+	// Where to start: chain[start] is known, and so is its parent if
+	//  start_parent_known
+	INODE_REFERENCE start_parent = 0;
+	int start_parent_known = 1;
+	INODE_REFERENCE start_inode;
+	int start = oufs_path_index_probe(component, length, hash, depth, &start_inode, &start_parent);
+	if (start > 0) {
+		chain[start] = start_inode;
+	} else if (path[0] != '/' && cwd_depth > 0 && low == cwd_depth && oufs_cwd_hint(cwd, &chain[cwd_depth])) {
+		start = cwd_depth;
+		start_parent_known = 0;
+	}
+	if (n_known > start) {
+		start = n_known;
+		start_parent = chain[start - 1];
+		start_parent_known = 1;
+	}
+
+	// Walk the rest
+	int d = start + 1;
+	for (; d <= depth; d++) {
+		int ret = oufs_lookup_component(chain[d - 1], component[d], length[d], &chain[d]);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+	}
+
+	// Only the last component missing?
+	int found = d > depth;
+	if (!found && (d < depth || !ends_with_name)) {
+		if (path[0] != '/' && d <= low)
+			fprintf(stderr, "Invalid cwd %s\n", cwd);
+		else
+			fprintf(stderr, "Improper path name %s\n", path);
+		return -1;
+	}
+
+	// A missing name can only be made in a directory
+	if (!found) {
+		INODE inode;
+		if (oufs_read_inode_by_reference(chain[depth - 1], &inode) < 0)
 			return -1;
+		if (inode.type != IT_DIRECTORY) {
+			fprintf(stderr, "Improper path name %s\n", path);
+			return -1;
+		}
+	}
+
+	// The directory at the end, and its parent
+	int end = found ? depth : depth - 1;
+	*child = chain[end];
+	if (end == 0)
+		*parent = 0;
+	else if (end > start)
+		*parent = chain[end - 1];
+	else if (start_parent_known)
+		*parent = start_parent;
+	else if (oufs_lookup_component(chain[end], "..", 2, parent) < 0)
+		return -1;
+
+	return found;
+}
+
+/**
+ * Resolve a path (see oufs_resolve())
+ *
+ * @param cwd Current working directory
+ * @param path Path to resolve
+ * @param parent Set to the parent inode reference
+ * @param child Set to the child inode reference
+ * @param name If not NULL, set to the last component of path (LONG_NAME_SIZE
+ *        bytes; "" if path has no components)
+ *
+ * @return 1 The path exists
+ *         0 Only the last component does not exist
+ *       < 0 Error
+ */
+int oufs_resolve_path(char *cwd, char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *name)
+{
+	return oufs_resolve(cwd, path, parent, child, name, NULL);
+}
+
+/**
+ * Given a cwd and path, walk to the end of path.  Return the child inode
+ * located at the end of the path and its parent (see oufs_resolve_path())
+ *
+ * @param cwd Current working directory
+ * @param path Path to search for
+ * @param parent Pointer to inode reference of parent which will be modified if found
+ * @param child Pointer to inode reference of child which will be modified if found
+ *
+ * @return 1 Found
+ *         0 Only the last component does not exist
+ *       < 0 Error
+ *
+ */
+int oufs_find_file (char * cwd, char * path, INODE_REFERENCE * parent, INODE_REFERENCE * child) {
+	return oufs_resolve_path(cwd, path, parent, child, NULL);
+}
+
+/**
+ * Given a byte (char) and a position in the byte (pos), flip
+ * the pos position in the character using a binary mask.
+ *
+ * @param byte Pointer to byte to modify
+ * @param pos Position of bit to flip
+ *
+ * @return 0 Success
+ *
+ */
+int oufs_flip_bit(char * byte, int pos) {
+
+	// Build binary mask using position
+	int mask = 1 << pos;
+
+	// Mask current byte to flip bit
+	*byte ^= mask;
+
+	return 0;
+}
+
+/**
+ * Given a byte, search for an available position in the byte
+ * that is currently a binary 0.
+ *
+ * @param byte Byte to search
+ * @param pos Pointer to position of available bit
+ *
+ * @return 1 Position found
+ * 	   0 No position available (i.e. byte_2 = 1111 1111)
+ *
+ */
+int oufs_find_available_bit(char byte, int * pos) {
+
+	for (int i = 0; i < 8; i++){
+		if (((byte >> i) & 0x01) == 0){
+			*pos = i;
+			// Return 1 if position is found
+			return 1;
+		}
+	}
+
+	// Return 0 if nothing is found
+	return 0;
+}
+
+/** 
+ * Given an array of bytes (chars) and a type, search each byte in the
+ * array for an available posision. When an available posision is found,
+ * modify the pos pointer to indicate which block posision was chosen.
+ *
+ * @param byte_array Array of characters to search for avaiable position
+ * @param pos Pointer to integer which will indicate which block was chosen
+ * @param type 'I' = Array is inode table, 'B' = Array is block table
+ *
+ * @return 0 Successfully modified byte_array and found position
+ * 	 < 0 Error processing byte array or unable to find position
+ *
+ */
+int oufs_find_bit_positions(unsigned char * byte_array, int * pos, char type) {
+
+	// Determine type of array
+	int size = 0;
+	if (type == 'I') { // inode table
+		size = (N_INODES >> 3);
+	} else if (type == 'B') { // block table
+		size = (N_BLOCKS_IN_DISK >> 3);
+	} else {
+		fprintf(stderr, "oufs_find_bit_positions(): Unknown type\n");
+		return -1;
+	}
+
+	// Loop through each character in the char array
+	int byte, bit;
+	for (int i = 0; i < size; i++) {
+
+		// Determine if a bit is available in the current row
+		if (oufs_find_available_bit(byte_array[i], &bit)) {
+			// Position is found, break loop
+			byte = i;
+			break;
 		} else {
-			strcpy(dir_name, basename_ptr);
+			// If no position was found in the current row, check to see if
+			// this is the last row. If so, there is no more room available.
+			if (i == size - 1) {
+				if (type == 'I') fprintf(stderr, "Not enough available inodes to make directory\n");
+				if (type == 'B') fprintf(stderr, "Not enough available blocks to make directory\n");
+				return -1;
+			}
 		}
+	}
+
+	// Flip proper bytes in char array
+	char new_byte = byte_array[byte];
+	oufs_flip_bit(&new_byte, bit);
+	byte_array[byte] = new_byte;
+
+	// Calculate the position of the block
+	*pos = 8 * byte + bit;
+
+	return 0;
+}
+
+/**
+ * Given a cwd and a path, make a directory path at cwd.
+ *
+ * @param cwd Pointer to current working directory path
+ * @param path Pointer to path to create
+ *
+ * @return 0 Successfully created directory
+ * 	 < 0 Error making directory
+ *
+ */
+int oufs_mkdir(char * cwd, char * path){
+
+	// Get inode references from search. The 'parent' inode is useless
+	// in this function, which is why its being labelled the grandparent.
+	// The child is effectivly the parent when making a new directory.
+	INODE_REFERENCE gparent_inode_ref, parent_inode_ref;
+
+	// Search to see if path already exists in cwd, and get the name of
+	// the directory from path
+	char dir_name[LONG_NAME_SIZE];
+	unsigned int path_hash;
+	int find_file = oufs_resolve (cwd, path, &gparent_inode_ref, &parent_inode_ref, dir_name, &path_hash);
+
+	if (find_file == 0) { // Make directory
 
 		// Read parent inode block
 		INODE parent_inode;
@@ -578,7 +1444,8 @@ int oufs_mkdir(char * cwd, char * path){
 		if (oufs_read_inode_by_reference(parent_inode_ref, &parent_inode) < 0) return -1;
 
 		// Check to see if parent can fit new directory
-		if (parent_inode.size == DIRECTORY_ENTRIES_PER_BLOCK) {
+		int n_entries = oufs_name_entries(strlen(dir_name));
+		if (parent_inode.size + n_entries > DIRECTORY_ENTRIES_PER_BLOCK) {
 			fprintf(stderr, "Not enough space in parent\n");
 			return -1;
 		}
@@ -594,11 +1461,18 @@ int oufs_mkdir(char * cwd, char * path){
 		int child_block_ref;
 		if (oufs_find_bit_positions(block_0.master.block_allocated_flag, &child_block_ref, 'B') < 0) return -1;
 
+		// Account for the new directory in every enclosing subtree
+		if (block_0.master.feature_flags & FEATURE_SUBTREE_COUNTERS) {
+			memset(&block_0.master.subtree[child_inode_ref], 0, sizeof(SUBTREE_COUNTER));
+			block_0.master.subtree[child_inode_ref].blocks = 1;
+			if (oufs_update_subtree_counters(&block_0, parent_inode_ref, 1, 1, 0) < 0) return -1;
+		}
+
 		// Write master block
 		if (vdisk_write_block(0, &block_0) < 0) return -1;
 
 		// Modify parent inode block
-		parent_inode.size = parent_inode.size + 1;
+		parent_inode.size = parent_inode.size + n_entries;
 		parent_block_ref = parent_inode.data[0];
 
 		// Write parent inode block
@@ -609,20 +1483,17 @@ int oufs_mkdir(char * cwd, char * path){
 		if (vdisk_read_block(parent_block_ref, &parent_dir_block) < 0) return -1;
 
 		// Modify parent directory block
-		for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-			if (parent_dir_block.directory.entry[i].inode_reference == UNALLOCATED_INODE) {
-				strcpy(parent_dir_block.directory.entry[i].name, dir_name);
-				parent_dir_block.directory.entry[i].inode_reference = child_inode_ref;
-				break;
-			}
-		}
+		oufs_directory_add(&parent_dir_block, dir_name, child_inode_ref);
 
 		// Write parent directory block
 		if (vdisk_write_block(parent_block_ref, &parent_dir_block) < 0) return -1;
+		if (oufs_bloom_update(parent_inode_ref, dir_name) < 0) return -1;
+		if (oufs_bloom_update(child_inode_ref, NULL) < 0) return -1;
 
 
-		// Build new directory block
+		// Build new directory block ("." and ".." are already in order)
 		BLOCK child_dir_block;
+		memset(&child_dir_block, 0, sizeof(child_dir_block));
 
 		for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
 			child_dir_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
@@ -634,6 +1505,7 @@ int oufs_mkdir(char * cwd, char * path){
 		child_dir_block.directory.entry[1].inode_reference = parent_inode_ref;
 
 		// Write new directory block
+		vdisk_cache_set_class(child_block_ref, 1, VDISK_CACHE_METADATA);
 		if (vdisk_write_block(child_block_ref, &child_dir_block) < 0) return -1;
 
 		// Make new inode 
@@ -652,6 +1524,9 @@ int oufs_mkdir(char * cwd, char * path){
 		// Write new inode 
 		if (oufs_write_inode_by_reference(child_inode_ref, &child_inode) < 0) return -1;
 
+		// Only now that the directory is complete can lookups find it directly
+		if (oufs_path_index_insert(path_hash, child_inode_ref, parent_inode_ref) < 0) return -1;
+
 	} else if (find_file == 1) { // Cant make directory, dir name exists
 
 		fprintf(stderr, "Unable to make directory %s, name exists.\n", path);
@@ -678,28 +1553,18 @@ int oufs_mkdir(char * cwd, char * path){
  */
 int oufs_rmdir(char * cwd, char * path) {
 
-	// Get name of directory from path
-	char dir_name[FILE_NAME_SIZE];
-	char temp[MAX_PATH_LENGTH];
-	strcpy(temp, path);
-	char * basename_ptr = basename(temp);
-	if (strlen(basename_ptr) > FILE_NAME_SIZE) {
-		fprintf(stderr, "Directory name too large\n");
-		return -1;
-	} else {
-		strcpy(dir_name, basename_ptr);
-	}
+	INODE_REFERENCE parent_inode_ref, child_inode_ref;
+
+	// See if the path even exists, and get the name of the directory from path
+	char dir_name[LONG_NAME_SIZE];
+	int found = oufs_resolve_path (cwd, path, &parent_inode_ref, &child_inode_ref, dir_name);
 
 	// Check to make sure name is legal
-	if (!strcmp(dir_name, ".") || !strcmp(dir_name, "..")) {
+	if (found >= 0 && (!strcmp(dir_name, ".") || !strcmp(dir_name, "..") || !dir_name[0])) {
 		fprintf(stderr, "Illegal name '%s'\n", dir_name);
 		return -1;
 	}
 
-	INODE_REFERENCE parent_inode_ref, child_inode_ref;
-
-	// See if the path even exists
-	int found = oufs_find_file (cwd, path, &parent_inode_ref, &child_inode_ref);
 	if (found == 0) {
 		fprintf(stderr, "Name does not exist\n");
 		return -1;
@@ -725,13 +1590,16 @@ int oufs_rmdir(char * cwd, char * path) {
 		return -1;
 	}
 
+	// Take the directory out of the path index before anything else changes
+	if (oufs_path_index_remove(child_inode_ref) < 0) return -1;
+
 	// Read in parent inode and get parent dir block from parent inode
 	INODE parent_inode;
 	if (oufs_read_inode_by_reference(parent_inode_ref, &parent_inode) < 0) return -1;
 	BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
 	
-	// Decrease parent inode size by 1
-	parent_inode.size--;
+	// Decrease parent inode size by the entries the name takes
+	parent_inode.size -= oufs_name_entries(strlen(dir_name));
 
 	// Write updated parent inode
 	if (oufs_write_inode_by_reference(parent_inode_ref, &parent_inode) < 0) return -1;
@@ -739,18 +1607,14 @@ int oufs_rmdir(char * cwd, char * path) {
 	// Find parent dir entry with dir_name, clear name, set inode_ref to UNALLOCATED_INODE
 	BLOCK parent_dir_block;
 	if (vdisk_read_block(parent_block_ref, &parent_dir_block) < 0) return -1;
-	
-	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-		if (!strcmp(dir_name, parent_dir_block.directory.entry[i].name)) {
-			memset(parent_dir_block.directory.entry[i].name, 0, sizeof(parent_dir_block.directory.entry[i].name));
-			parent_dir_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
-			break;
-		}
-	}
+	int compacted = oufs_directory_remove(&parent_dir_block, dir_name);
 
 	// Write updated parent block
 	if (vdisk_write_block(parent_block_ref, &parent_dir_block) < 0) return -1;
 
+	// A compacted directory also sheds the Bloom filter bits of removed names
+	if (compacted && oufs_bloom_rebuild(parent_inode_ref, &parent_dir_block) < 0) return -1;
+
 	// Create empty inode and block, write them to child inode ref and child block ref
 	INODE empty_inode;
 	BLOCK empty_block;
@@ -758,6 +1622,7 @@ int oufs_rmdir(char * cwd, char * path) {
 	memset(&empty_block, 0, sizeof(empty_block));
 	if (oufs_write_inode_by_reference(child_inode_ref, &empty_inode) < 0) return -1;
 	if (vdisk_write_block(child_block_ref, &empty_block) < 0) return -1;
+	vdisk_cache_set_class(child_block_ref, 1, VDISK_CACHE_DATA);
 
 	// Read in master block, update both tables, write back to disk
 	BLOCK master_block;
@@ -778,6 +1643,17 @@ int oufs_rmdir(char * cwd, char * path) {
 	master_block.master.inode_allocated_flag[i_byte] = new_i_flag;
 	master_block.master.block_allocated_flag[b_byte] = new_b_flag;
 
+	// Remove the directory from every enclosing subtree
+	if (master_block.master.feature_flags & FEATURE_SUBTREE_COUNTERS) {
+		memset(&master_block.master.subtree[child_inode_ref], 0, sizeof(SUBTREE_COUNTER));
+		if (oufs_update_subtree_counters(&master_block, parent_inode_ref, -1, -1, 0) < 0) return -1;
+	}
+
+	// Saved inode references may now name a removed directory
+	master_block.master.namespace_generation++;
+	if (cwd_hint.state == CWD_HINT_VALID)
+		cwd_hint.state = CWD_HINT_UNCHECKED;
+
 	if (vdisk_write_block(0, &master_block) < 0) return -1;
 
 	return 0;
@@ -809,8 +1685,23 @@ int oufs_find_open_bit(unsigned char byte) {
 }
 
 /**
- * Comparator used for qsort. Sorts a DIRECTORY_ENTRY struct by the
- * directory names it holds.
+ * Rank of a name in directory order: . and .. come before all others
+ *
+ * @param name Name
+ *
+ * @return 0 for ., 1 for .., 2 for any other name
+ */
+static int oufs_name_rank(const char *name) {
+	if (!strcmp(name, "."))
+		return 0;
+	if (!strcmp(name, ".."))
+		return 1;
+	return 2;
+}
+
+/**
+ * Comparator used for qsort. Sorts an OUFS_DIR_NAME struct by the
+ * name it holds, . and .. first.
  *
  * @param a Pointer to first comparison
  * @param b Pointer to second comparison
@@ -819,23 +1710,246 @@ int oufs_find_open_bit(unsigned char byte) {
  *
  */
 int oufs_comparator(const void *a, const void *b) {
-	DIRECTORY_ENTRY const * aa = (DIRECTORY_ENTRY const *) a;
-	DIRECTORY_ENTRY const * bb = (DIRECTORY_ENTRY const *) b;
-	return strncmp(aa->name, bb->name, sizeof(char *));
+	OUFS_DIR_NAME const * aa = (OUFS_DIR_NAME const *) a;
+	OUFS_DIR_NAME const * bb = (OUFS_DIR_NAME const *) b;
+	int rank = oufs_name_rank(aa->name) - oufs_name_rank(bb->name);
+	return rank != 0 ? rank : strcmp(aa->name, bb->name);
+}
+
+/**
+ * Read the names in a directory block, with the inodes they refer to
+ *
+ * @param block Directory block
+ * @param names Set to the names (DIRECTORY_ENTRIES_PER_BLOCK of them at most)
+ * @param sort Nonzero to sort the names; otherwise they are in block order
+ *
+ * @return Number of names
+ *
+ */
+int oufs_directory_names(BLOCK * block, OUFS_DIR_NAME * names, int sort) {
+
+	int n = 0;
+	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+		if (oufs_entry_name(block, i, names[n].name) > 0)
+			names[n++].inode_reference = block->directory.entry[i].inode_reference;
+	}
+	if (sort)
+		qsort(names, n, sizeof(OUFS_DIR_NAME), oufs_comparator);
+	return n;
+}
+
+/**
+ * Move the allocated entries of a directory block to the front, keeping
+ * their order, and clear the rest
+ *
+ * @param block Directory block
+ *
+ * @return Number of allocated entries
+ *
+ */
+static int oufs_pack_directory(BLOCK * block) {
+
+	int n = 0;
+	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+		if (block->directory.entry[i].inode_reference != UNALLOCATED_INODE)
+			block->directory.entry[n++] = block->directory.entry[i];
+	for (int i = n; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+		oufs_clean_directory_entry(&block->directory.entry[i]);
+		memset(block->directory.entry[i].name, 0, FILE_NAME_SIZE);
+	}
+	return n;
+}
+
+/**
+ * Put the allocated entries of a directory block first, . and .. and
+ * then the others in name order, and clear the rest (the layout of
+ * FEATURE_SORTED_DIRECTORIES)
+ *
+ * @param block Directory block
+ *
+ * @return Number of allocated entries
+ *
+ */
+int oufs_sort_directory(BLOCK * block) {
+
+	OUFS_DIR_NAME names[DIRECTORY_ENTRIES_PER_BLOCK];
+	int n_names = oufs_directory_names(block, names, 1);
+
+	// Lay the names out again from the front, each followed by its
+	//  continuation entries
+	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+		oufs_clean_directory_entry(&block->directory.entry[i]);
+		memset(block->directory.entry[i].name, 0, FILE_NAME_SIZE);
+	}
+	int n = 0;
+	for (int i = 0; i < n_names; i++)
+		n += oufs_entry_store(block, n, names[i].name, names[i].inode_reference);
+	return n;
+}
+
+/**
+ * Add an entry to a directory block that has room for it.  On a disk with
+ * sorted directories it goes in name order; otherwise in the first run of
+ * free slots long enough for the name.  If the free slots are too
+ * scattered for a long name, the block is packed first
+ *
+ * @param block Directory block
+ * @param name Name of the entry
+ * @param inode_reference Inode the entry refers to
+ *
+ */
+void oufs_directory_add(BLOCK * block, char * name, INODE_REFERENCE inode_reference) {
+
+	DIRECTORY_ENTRY * entry = block->directory.entry;
+	int need = oufs_name_entries(strlen(name));
+	int i = 0;
+
+	if (oufs_directories_sorted()) {
+		// Entries that sort after the name move up to make room.  . and ..
+		//  keep slots 0 and 1
+		char entry_name[LONG_NAME_SIZE];
+		int n = 0, k;
+		i = 2;
+		while (n < DIRECTORY_ENTRIES_PER_BLOCK && entry[n].inode_reference != UNALLOCATED_INODE)
+			n++;
+		while (i < n && (k = oufs_entry_name(block, i, entry_name)) > 0 && strcmp(entry_name, name) < 0)
+			i += k;
+		memmove(&entry[i + need], &entry[i], (n - i) * sizeof(DIRECTORY_ENTRY));
+	} else {
+		int run = 0;
+		for (; i < DIRECTORY_ENTRIES_PER_BLOCK && run < need; i++)
+			run = entry[i].inode_reference == UNALLOCATED_INODE ? run + 1 : 0;
+		if (run < need)
+			i = oufs_pack_directory(block);
+		else
+			i -= need;
+	}
+
+	oufs_entry_store(block, i, name, inode_reference);
+}
+
+/**
+ * Count the dead slots of a directory block: free slots that come before
+ * its last allocated entry, which a scan of the block still has to step
+ * over
+ *
+ * @param block Directory block
+ *
+ * @return Number of dead slots
+ *
+ */
+int oufs_directory_dead_slots(BLOCK * block) {
+
+	int dead = 0, free = 0;
+	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+		if (block->directory.entry[i].inode_reference == UNALLOCATED_INODE) {
+			free++;
+		} else {
+			dead += free;
+			free = 0;
+		}
+	}
+	return dead;
+}
+
+// Dead slots that make oufs_directory_remove() compact a directory block
+#define DIRECTORY_COMPACT_DEAD 4
+
+/**
+ * Remove an entry, and the continuation entries of its name, from a
+ * directory block.  On a disk with sorted directories the entries after
+ * it move down, so no hole is left.
+ * Otherwise the slot is freed in place, and once the block has
+ * DIRECTORY_COMPACT_DEAD dead slots its live entries are moved to the
+ * front, in the same order
+ *
+ * @param block Directory block
+ * @param name Name of the entry
+ *
+ * @return 1 if the block was compacted; 0 if not
+ *
+ */
+int oufs_directory_remove(BLOCK * block, char * name) {
+
+	DIRECTORY_ENTRY * entry = block->directory.entry;
+	char entry_name[LONG_NAME_SIZE];
+	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+		int n = oufs_entry_name(block, i, entry_name);
+		if (n > 0 && !strcmp(entry_name, name)) {
+			if (oufs_directories_sorted()) {
+				memmove(&entry[i], &entry[i + n], (DIRECTORY_ENTRIES_PER_BLOCK - n - i) * sizeof(DIRECTORY_ENTRY));
+				for (int k = DIRECTORY_ENTRIES_PER_BLOCK - n; k < DIRECTORY_ENTRIES_PER_BLOCK; k++) {
+					oufs_clean_directory_entry(&entry[k]);
+					memset(entry[k].name, 0, FILE_NAME_SIZE);
+				}
+				return 1;
+			}
+			for (int k = i; k < i + n; k++) {
+				oufs_clean_directory_entry(&entry[k]);
+				memset(entry[k].name, 0, FILE_NAME_SIZE);
+			}
+			break;
+		}
+	}
+
+	if (oufs_directory_dead_slots(block) < DIRECTORY_COMPACT_DEAD) return 0;
+	oufs_pack_directory(block);
+	return 1;
+}
+
+// Longest line printed for one directory entry
+#define LIST_LINE_SIZE (24 + LONG_NAME_SIZE)
+
+// Longest line printed for a path given on the command line
+#define LIST_PATH_LINE_SIZE (LIST_LINE_SIZE + MAX_PATH_LENGTH)
+
+/**
+ * Format a single listing line for a directory entry, or for a path,
+ * into buf.
+ *
+ * @param buf Buffer to format into
+ * @param size Size of buf: LIST_LINE_SIZE for a directory entry's name,
+ *        LIST_PATH_LINE_SIZE for a path
+ * @param name Name or path to print
+ * @param name_size Most characters of name to print (LONG_NAME_SIZE for
+ *        the name of a directory entry)
+ * @param inode Inode the name refers to
+ * @param long_format Nonzero to include type, link count, size and block count
+ *
+ * @return Number of characters written to buf
+ *
+ */
+int oufs_format_list_line(char * buf, int size, char * name, int name_size, INODE * inode, int long_format) {
+
+	// Directories get a trailing '/'
+	char * suffix = inode->type == IT_DIRECTORY ? "/" : "";
+
+	if (!long_format)
+		return snprintf(buf, size, "%.*s%s\n", name_size, name, suffix);
+
+	// Count the data blocks in use
+	int n_blocks = 0;
+	for (int i = 0; i < BLOCKS_PER_INODE; i++)
+		if (inode->data[i] != UNALLOCATED_BLOCK) n_blocks++;
+
+	return snprintf(buf, size, "%c %3d %6u %3d %.*s%s\n", inode->type, inode->n_references,
+			inode->size, n_blocks, name_size, name, suffix);
 }
 
 /**
- * Given a cwd and a pth, print the contents of path found under
- * the current working directory.
+ * Given a cwd and a path, print the contents of path found under
+ * the current working directory. The inodes of all entries are fetched
+ * together and the output is written in one piece.
  *
  * @param cwd Pointer to current working directory value
  * @param path Pointer to path value
+ * @param long_format Nonzero to print type, link count, size and block count
  *
  * @return 0 Successfully printed directory
  *       < 0 Error printing directory
  *
  */
-int oufs_list(char * cwd, char * path) {
+int oufs_list_directory(char * cwd, char * path, int long_format) {
 
 	// If no path is given, use cwd as path
 	if (!path) path = ".";
@@ -858,9 +1972,14 @@ int oufs_list(char * cwd, char * path) {
 	memset(&inode, 0, sizeof(inode));
 	if (oufs_read_inode_by_reference(inode_ref, &inode) < 0) return -1;		
 
+	char out[DIRECTORY_ENTRIES_PER_BLOCK * LIST_LINE_SIZE];
+	int length = 0;
+
 	// Check to see if inode is a file
 	if (inode.type == IT_FILE) {
-		fprintf(stdout, "%s\n", path);
+		char line[LIST_PATH_LINE_SIZE];
+		length = oufs_format_list_line(line, sizeof(line), path, MAX_PATH_LENGTH, &inode, long_format);
+		fwrite(line, 1, length, stdout);
 		return 0;
 	} else if (inode.type == IT_NONE) {
 		return -1;
@@ -871,32 +1990,1484 @@ int oufs_list(char * cwd, char * path) {
 	memset(&dir_block, 0, sizeof(dir_block));
 	if (vdisk_read_block(inode.data[0], &dir_block) < 0) return -1;
 
-	// Sort dir_block by name
-	qsort(dir_block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, sizeof(*dir_block.directory.entry), oufs_comparator);
+	// Read the names in order, sorting them unless the disk keeps them sorted
+	OUFS_DIR_NAME entries[DIRECTORY_ENTRIES_PER_BLOCK];
+	int n_entries = oufs_directory_names(&dir_block, entries, !oufs_directories_sorted());
 
-	// Loop through directory entries in loaded block
-	INODE temp_inode;
-	for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+	// Gather the inode references of all allocated entries
+	INODE_REFERENCE refs[DIRECTORY_ENTRIES_PER_BLOCK];
+	INODE inodes[DIRECTORY_ENTRIES_PER_BLOCK];
+	for (int i = 0; i < n_entries; i++)
+		refs[i] = entries[i].inode_reference;
+
+	// Read each inode block once for all of the entries
+	if (oufs_read_inodes_by_reference(refs, n_entries, inodes) < 0) return -1;
+
+	// Build the listing and print it
+	for (int i = 0; i < n_entries; i++)
+		length += oufs_format_list_line(out + length, LIST_LINE_SIZE, entries[i].name, LONG_NAME_SIZE, &inodes[i], long_format);
+	fwrite(out, 1, length, stdout);
+
+	return 0;
+}
+
+/**
+ * Given a cwd and a path, print the names of the contents of path.
+ *
+ * @param cwd Pointer to current working directory value
+ * @param path Pointer to path value
+ *
+ * @return 0 Successfully printed directory
+ *       < 0 Error printing directory
+ *
+ */
+int oufs_list(char * cwd, char * path) {
+	return oufs_list_directory(cwd, path, 0);
+}
+
+/**
+ * Given a cwd and a path, print the type, link count, size, block count
+ * and name of the contents of path.
+ *
+ * @param cwd Pointer to current working directory value
+ * @param path Pointer to path value
+ *
+ * @return 0 Successfully printed directory
+ *       < 0 Error printing directory
+ *
+ */
+int oufs_list_long(char * cwd, char * path) {
+	return oufs_list_directory(cwd, path, 1);
+}
+
+/**
+ * Comparator used for qsort. Sorts an array of inode references by the
+ * inode block that holds each of them.
+ *
+ * @param a Pointer to first comparison
+ * @param b Pointer to second comparison
+ *
+ * @return Value of comparison (-1, 0, 1)
+ *
+ */
+int oufs_inode_block_comparator(const void *a, const void *b) {
+	INODE_REFERENCE aa = *(INODE_REFERENCE const *) a;
+	INODE_REFERENCE bb = *(INODE_REFERENCE const *) b;
+	return (aa / INODES_PER_BLOCK > bb / INODES_PER_BLOCK) - (aa / INODES_PER_BLOCK < bb / INODES_PER_BLOCK);
+}
+
+/**
+ * Read a group of inodes. Each inode block is read from the virtual disk at
+ * most once, no matter how many of the requested inodes it holds.
+ *
+ * @param refs Array of n inode references to read
+ * @param n Number of inode references
+ * @param inodes Array of n inodes. inodes[i] is filled in with the inode for refs[i]
+ *
+ * @return 0 Successfully read all inodes
+ *       < 0 Error reading an inode block
+ *
+ */
+int oufs_read_inodes_by_reference(INODE_REFERENCE *refs, int n, INODE *inodes) {
 
-		// Loop through all allocated entries in directory
-		if (dir_block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-			// Clear temp inode
-			memset(&inode, 0, sizeof(inode));
+	// Sort a copy of the references so each inode block is visited once
+	INODE_REFERENCE sorted[n > 0 ? n : 1];
+	memcpy(sorted, refs, n * sizeof(INODE_REFERENCE));
+	qsort(sorted, n, sizeof(INODE_REFERENCE), oufs_inode_block_comparator);
 
-			// Read inode reference in directory
-			oufs_read_inode_by_reference(dir_block.directory.entry[i].inode_reference, &temp_inode);
+	BLOCK block;
+	for (int i = 0; i < n; i++) {
 
-			// Print first part of entry
-			fprintf(stdout, "%s", dir_block.directory.entry[i].name);
+		// Skip references to blocks that are already loaded
+		BLOCK_REFERENCE block_ref = sorted[i] / INODES_PER_BLOCK + 1;
+		if (i > 0 && block_ref == sorted[i - 1] / INODES_PER_BLOCK + 1) continue;
 
-			// Check to see if entry is a directory, append '/' if so
-			if (temp_inode.type == IT_DIRECTORY)
-				fputs("/", stdout);
+		if (vdisk_read_block(block_ref, &block) < 0) return -1;
 
-			// Finish with newline
-			fputs("\n", stdout);
+		// Copy out every requested inode that lives in this block
+		for (int j = 0; j < n; j++) {
+			if (refs[j] / INODES_PER_BLOCK + 1 == block_ref)
+				inodes[j] = block.inodes.inode[refs[j] % INODES_PER_BLOCK];
 		}
 	}
 
+	// Open files have the current copy in memory
+	for (int j = 0; j < n; j++) {
+		if (refs[j] < N_INODES && open_inode[refs[j]].n_open > 0)
+			inodes[j] = open_inode[refs[j]].inode;
+	}
+
 	return 0;
 }
+
+// Number of resolved directories remembered during one oufs_stat_many() call
+#define STAT_DIRECTORY_CACHE_SIZE 32
+
+// State shared by all of the path walks in one oufs_stat_many() call
+typedef struct stat_context_s
+{
+	// Absolute paths that have already been resolved, and their inodes
+	char path[STAT_DIRECTORY_CACHE_SIZE][MAX_PATH_LENGTH];
+	INODE_REFERENCE inode_reference[STAT_DIRECTORY_CACHE_SIZE];
+	int n_paths;
+} STAT_CONTEXT;
+
+/**
+ * Resolve an absolute path, reusing the walks of any prefix that was
+ * already resolved in this context.
+ *
+ * @param context Shared lookup state
+ * @param path Absolute path with no repeated or trailing '/'
+ * @param inode_reference Pointer to populate if the path is found
+ *
+ * @return 1 Path found
+ *         0 Path does not exist
+ *       < 0 Error reading the virtual disk
+ *
+ */
+int oufs_stat_resolve(STAT_CONTEXT *context, char *path, INODE_REFERENCE *inode_reference) {
+
+	// Root is always inode 0
+	if (!strcmp(path, "/")) {
+		*inode_reference = 0;
+		return 1;
+	}
+
+	// Shared prefix?
+	for (int i = 0; i < context->n_paths; i++) {
+		if (!strcmp(context->path[i], path)) {
+			*inode_reference = context->inode_reference[i];
+			return 1;
+		}
+	}
+
+	// Split into the parent directory and the final name
+	char dir[MAX_PATH_LENGTH];
+	char * name = strrchr(path, '/');
+	int dir_length = name == path ? 1 : name - path;
+	strncpy(dir, path, dir_length);
+	dir[dir_length] = 0;
+	name++;
+
+	// Resolve the parent first
+	INODE_REFERENCE dir_inode_ref;
+	int found = oufs_stat_resolve(context, dir, &dir_inode_ref);
+	if (found < 1) return found;
+
+	// Search the parent for the name
+	found = oufs_lookup_component(dir_inode_ref, name, strlen(name), inode_reference);
+	if (found < 1) return found;
+
+	// Remember it for later paths that share this prefix
+	if (context->n_paths < STAT_DIRECTORY_CACHE_SIZE) {
+		strcpy(context->path[context->n_paths], path);
+		context->inode_reference[context->n_paths++] = *inode_reference;
+	}
+	return 1;
+}
+
+/**
+ * Comparator used for qsort. Sorts an array of path pointers by name.
+ *
+ * @param a Pointer to first comparison
+ * @param b Pointer to second comparison
+ *
+ * @return Value of comparison (-1, 0, 1)
+ *
+ */
+int oufs_path_comparator(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Given a cwd and an array of paths, look up the inode of every path.
+ * Paths are resolved in sorted order so that common prefixes are only
+ * walked once, and the inodes are then read one inode block at a time.
+ *
+ * @param cwd Current working directory
+ * @param paths Array of n paths to look up
+ * @param n Number of paths
+ * @param results Array of n results. results[i] is filled in for paths[i]
+ *
+ * @return Number of paths that were found
+ *       < 0 Error reading the virtual disk
+ *
+ */
+int oufs_stat_many(char * cwd, char ** paths, int n, OUFS_STAT * results) {
+
+	// Build the absolute form of every path
+	char (*absolute)[MAX_PATH_LENGTH] = malloc(n * MAX_PATH_LENGTH + 1);
+	char ** sorted = malloc(n * sizeof(char *) + 1);
+	if (!absolute || !sorted) {
+		fprintf(stderr, "oufs_stat_many(): out of memory\n");
+		free(absolute);
+		free(sorted);
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		char joined[2 * MAX_PATH_LENGTH];
+		snprintf(joined, sizeof(joined), "%s/%s", paths[i][0] == '/' ? "" : cwd, paths[i]);
+
+		// Drop repeated and trailing '/'
+		int length = 0;
+		for (char * c = joined; *c && length < MAX_PATH_LENGTH - 1; c++) {
+			if (*c == '/' && (length > 0 && absolute[i][length - 1] == '/')) continue;
+			absolute[i][length++] = *c;
+		}
+		if (length > 1 && absolute[i][length - 1] == '/') length--;
+		absolute[i][length] = 0;
+
+		sorted[i] = absolute[i];
+	}
+	qsort(sorted, n, sizeof(char *), oufs_path_comparator);
+
+	// Walk the paths in sorted order
+	STAT_CONTEXT * context = malloc(sizeof(STAT_CONTEXT));
+	INODE_REFERENCE * refs = malloc(n * sizeof(INODE_REFERENCE) + 1);
+	INODE * inodes = malloc(n * sizeof(INODE) + 1);
+	int * owner = malloc(n * sizeof(int) + 1);
+	if (!context || !refs || !inodes || !owner) {
+		fprintf(stderr, "oufs_stat_many(): out of memory\n");
+		free(absolute);
+		free(sorted);
+		free(context);
+		free(refs);
+		free(inodes);
+		free(owner);
+		return -1;
+	}
+	context->n_paths = 0;
+
+	int n_found = 0;
+	for (int i = 0; i < n; i++) {
+		int index = (char (*)[MAX_PATH_LENGTH]) sorted[i] - absolute;
+		INODE_REFERENCE ref;
+		results[index].status = oufs_stat_resolve(context, sorted[i], &ref);
+		if (results[index].status == 1) {
+			results[index].inode_reference = ref;
+			refs[n_found] = ref;
+			owner[n_found++] = index;
+		}
+	}
+
+	// Fetch all of the inodes together
+	int ret = n_found;
+	if (oufs_read_inodes_by_reference(refs, n_found, inodes) < 0) {
+		ret = -1;
+	} else {
+		for (int i = 0; i < n_found; i++)
+			results[owner[i]].inode = inodes[i];
+	}
+
+	free(absolute);
+	free(sorted);
+	free(context);
+	free(refs);
+	free(inodes);
+	free(owner);
+	return ret;
+}
+
+// Node table being sorted by oufs_walk_block_comparator (qsort has no context argument)
+static OUFS_WALK_NODE * walk_nodes;
+
+/**
+ * Comparator used for qsort. Sorts an array of node indices by the
+ * address of the directory block each directory node refers to.
+ *
+ * @param a Pointer to first comparison
+ * @param b Pointer to second comparison
+ *
+ * @return Value of comparison (-1, 0, 1)
+ *
+ */
+int oufs_walk_block_comparator(const void *a, const void *b) {
+	BLOCK_REFERENCE aa = walk_nodes[*(int const *) a].inode.data[0];
+	BLOCK_REFERENCE bb = walk_nodes[*(int const *) b].inode.data[0];
+	return (aa > bb) - (aa < bb);
+}
+
+/**
+ * Given a cwd and a path, find every entry below path. The tree is walked
+ * one level at a time: the directory blocks of a level are read in block
+ * address order, then the inodes of all entries they hold are read together.
+ *
+ * @param cwd Current working directory
+ * @param path Directory (or file) to start from
+ * @param max_depth Deepest level to descend to (< 0 for no limit)
+ * @param nodes Array to fill with the starting point followed by every entry found
+ * @param max_nodes Size of nodes
+ *
+ * @return Number of nodes filled in
+ *       < 0 Path does not exist, too many entries or error reading the disk
+ *
+ */
+int oufs_walk(char * cwd, char * path, int max_depth, OUFS_WALK_NODE * nodes, int max_nodes) {
+
+	// Locate the starting point
+	OUFS_STAT start;
+	if (oufs_stat_many(cwd, &path, 1, &start) < 1) {
+		fprintf(stderr, "File does not exist\n");
+		return -1;
+	}
+
+	strncpy(nodes[0].path, path, MAX_PATH_LENGTH - 1);
+	nodes[0].path[MAX_PATH_LENGTH - 1] = 0;
+	nodes[0].inode_reference = start.inode_reference;
+	nodes[0].inode = start.inode;
+	nodes[0].parent = -1;
+	nodes[0].depth = 0;
+	nodes[0].first_child = 1;
+	nodes[0].n_children = 0;
+
+	int n_nodes = 1;
+	int level_start = 0;
+	int level_end = 1;
+	int depth = 0;
+	walk_nodes = nodes;
+
+	while (level_start < level_end && (max_depth < 0 || depth < max_depth)) {
+
+		// Directories on this level, in directory block order
+		int dirs[level_end - level_start];
+		int n_dirs = 0;
+		for (int i = level_start; i < level_end; i++)
+			if (nodes[i].inode.type == IT_DIRECTORY) dirs[n_dirs++] = i;
+		qsort(dirs, n_dirs, sizeof(int), oufs_walk_block_comparator);
+
+		for (int d = 0; d < n_dirs; d++) {
+			OUFS_WALK_NODE * dir = &nodes[dirs[d]];
+
+			BLOCK dir_block;
+			if (vdisk_read_block(dir->inode.data[0], &dir_block) < 0) return -1;
+			OUFS_DIR_NAME entries[DIRECTORY_ENTRIES_PER_BLOCK];
+			int n_entries = oufs_directory_names(&dir_block, entries, 1);
+
+			// Separator between the directory's path and its entries
+			int dir_length = strlen(dir->path);
+			char * separator = dir_length > 0 && dir->path[dir_length - 1] == '/' ? "" : "/";
+
+			dir->first_child = n_nodes;
+			for (int i = 0; i < n_entries; i++) {
+				OUFS_DIR_NAME * entry = &entries[i];
+				if (!strcmp(entry->name, ".") || !strcmp(entry->name, ".."))
+					continue;
+
+				if (n_nodes == max_nodes) {
+					fprintf(stderr, "oufs_walk(): too many entries\n");
+					return -1;
+				}
+
+				char child_path[MAX_PATH_LENGTH + LONG_NAME_SIZE + 1];
+				if (snprintf(child_path, sizeof(child_path), "%s%s%s", dir->path, separator, entry->name) >= MAX_PATH_LENGTH) {
+					fprintf(stderr, "oufs_walk(): path too long\n");
+					return -1;
+				}
+
+				OUFS_WALK_NODE * node = &nodes[n_nodes++];
+				strcpy(node->path, child_path);
+				node->inode_reference = entry->inode_reference;
+				node->parent = dir - nodes;
+				node->depth = depth + 1;
+				node->first_child = n_nodes;
+				node->n_children = 0;
+				dir->n_children++;
+			}
+		}
+
+		// Fetch the inodes of the whole next level at once
+		INODE_REFERENCE refs[n_nodes - level_end + 1];
+		INODE inodes[n_nodes - level_end + 1];
+		for (int i = level_end; i < n_nodes; i++)
+			refs[i - level_end] = nodes[i].inode_reference;
+		if (oufs_read_inodes_by_reference(refs, n_nodes - level_end, inodes) < 0) return -1;
+		for (int i = level_end; i < n_nodes; i++)
+			nodes[i].inode = inodes[i - level_end];
+
+		level_start = level_end;
+		level_end = n_nodes;
+		depth++;
+	}
+
+	return n_nodes;
+}
+
+/**
+ * Print the listing of one walked directory, then recurse into its
+ * subdirectories.
+ *
+ * @param nodes Node table filled in by oufs_walk()
+ * @param index Node of the directory to print
+ * @param long_format Nonzero to print type, link count, size and block count
+ *
+ */
+void oufs_list_walk_node(OUFS_WALK_NODE * nodes, int index, int long_format) {
+
+	OUFS_WALK_NODE * dir = &nodes[index];
+
+	// Build the listing and print it
+	char out[DIRECTORY_ENTRIES_PER_BLOCK * LIST_LINE_SIZE + MAX_PATH_LENGTH + 3];
+	int length = snprintf(out, MAX_PATH_LENGTH + 3, "%s%s:\n", index ? "\n" : "", dir->path);
+	for (int i = dir->first_child; i < dir->first_child + dir->n_children; i++)
+		length += oufs_format_list_line(out + length, LIST_LINE_SIZE, strrchr(nodes[i].path, '/') + 1, LONG_NAME_SIZE,
+				&nodes[i].inode, long_format);
+	fwrite(out, 1, length, stdout);
+
+	for (int i = dir->first_child; i < dir->first_child + dir->n_children; i++)
+		if (nodes[i].inode.type == IT_DIRECTORY)
+			oufs_list_walk_node(nodes, i, long_format);
+}
+
+/**
+ * Given a cwd and a path, print the contents of path and of every
+ * directory below it.
+ *
+ * @param cwd Pointer to current working directory value
+ * @param path Pointer to path value
+ * @param long_format Nonzero to print type, link count, size and block count
+ *
+ * @return 0 Successfully printed the tree
+ *       < 0 Error printing the tree
+ *
+ */
+int oufs_list_recursive(char * cwd, char * path, int long_format) {
+
+	OUFS_WALK_NODE nodes[OUFS_WALK_MAX_NODES];
+	if (oufs_walk(cwd, path, -1, nodes, OUFS_WALK_MAX_NODES) < 0) return -1;
+
+	// A file lists as itself
+	if (nodes[0].inode.type != IT_DIRECTORY) {
+		char out[LIST_PATH_LINE_SIZE];
+		fwrite(out, 1, oufs_format_list_line(out, sizeof(out), path, MAX_PATH_LENGTH, &nodes[0].inode, long_format), stdout);
+		return 0;
+	}
+
+	oufs_list_walk_node(nodes, 0, long_format);
+	return 0;
+}
+
+/**
+ * Add to the subtree counters of a directory and of every directory above
+ * it, following the ".." entries up to the root. The caller is responsible
+ * for writing the master block back to the disk.
+ *
+ * @param master Master block holding the counters
+ * @param dir Inode reference of the innermost directory to update
+ * @param entries Change in the number of entries
+ * @param blocks Change in the number of data blocks
+ * @param bytes Change in the number of file bytes
+ *
+ * @return 0 Successfully updated the counters
+ *       < 0 Error reading a directory
+ *
+ */
+int oufs_update_subtree_counters(BLOCK * master, INODE_REFERENCE dir, int entries, int blocks, int bytes) {
+
+	for (;;) {
+		SUBTREE_COUNTER * counter = &master->master.subtree[dir];
+		counter->entries += entries;
+		counter->blocks += blocks;
+		counter->bytes += bytes;
+
+		// Root is its own parent
+		if (dir == 0) return 0;
+
+		// Move up to the parent
+		INODE inode;
+		BLOCK block;
+		if (oufs_read_inode_by_reference(dir, &inode) < 0) return -1;
+		if (vdisk_read_block(inode.data[0], &block) < 0) return -1;
+		INODE_REFERENCE parent = UNALLOCATED_INODE;
+		for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+			if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE
+					&& block.directory.entry[i].inode_reference != CONTINUATION_INODE && !strcmp(block.directory.entry[i].name, "..")) {
+				parent = block.directory.entry[i].inode_reference;
+				break;
+			}
+		}
+		if (parent == UNALLOCATED_INODE) {
+			fprintf(stderr, "oufs_update_subtree_counters(): directory %d has no parent\n", dir);
+			return -1;
+		}
+		dir = parent;
+	}
+}
+
+/**
+ * Compute the subtree counters of every directory by walking the whole tree.
+ *
+ * @param counters Array of N_INODES counters, indexed by inode. Entries for
+ *                 inodes that are not directories are zeroed
+ *
+ * @return 0 Successfully computed the counters
+ *       < 0 Error walking the tree
+ *
+ */
+int oufs_compute_subtree_counters(SUBTREE_COUNTER * counters) {
+
+	OUFS_WALK_NODE nodes[OUFS_WALK_MAX_NODES];
+	int n_nodes = oufs_walk("/", "/", -1, nodes, OUFS_WALK_MAX_NODES);
+	if (n_nodes < 0) return -1;
+
+	// Each node's own usage
+	int entries[n_nodes];
+	int blocks[n_nodes];
+	int bytes[n_nodes];
+	for (int i = 0; i < n_nodes; i++) {
+		entries[i] = 0;
+		blocks[i] = 0;
+		bytes[i] = nodes[i].inode.type == IT_FILE ? nodes[i].inode.size : 0;
+		for (int j = 0; j < BLOCKS_PER_INODE; j++)
+			if (nodes[i].inode.data[j] != UNALLOCATED_BLOCK) blocks[i]++;
+	}
+
+	// Children always come after their parent
+	for (int i = n_nodes - 1; i > 0; i--) {
+		entries[nodes[i].parent] += entries[i] + 1;
+		blocks[nodes[i].parent] += blocks[i];
+		bytes[nodes[i].parent] += bytes[i];
+	}
+
+	memset(counters, 0, N_INODES * sizeof(SUBTREE_COUNTER));
+	for (int i = 0; i < n_nodes; i++) {
+		if (nodes[i].inode.type == IT_DIRECTORY) {
+			counters[nodes[i].inode_reference].entries = entries[i];
+			counters[nodes[i].inode_reference].blocks = blocks[i];
+			counters[nodes[i].inode_reference].bytes = bytes[i];
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Store a changed inode. The inode of an open file is only updated in the
+ * open file table and written out when its last OUFILE is closed; any
+ * other inode is written straight to the disk.
+ *
+ * @param i Inode reference
+ * @param inode New contents of the inode
+ *
+ * @return 0 Successfully stored the inode
+ *       < 0 Error writing the inode
+ *
+ */
+int oufs_store_inode(INODE_REFERENCE i, INODE * inode) {
+
+	if (i < N_INODES && open_inode[i].n_open > 0) {
+		open_inode[i].inode = *inode;
+		open_inode[i].dirty = 1;
+		return 0;
+	}
+
+	return oufs_write_inode_by_reference(i, inode);
+}
+
+/**
+ * Given a cwd, a path and a mode, open a file. Mode "r" reads from the
+ * start of the file, "w" truncates the file and "a" appends to it. A file
+ * opened with "w" or "a" is created if it does not exist.
+ *
+ * @param cwd Current working directory
+ * @param path Path of the file to open
+ * @param mode "r", "w" or "a"
+ *
+ * @return Pointer to the open file
+ *         NULL Error opening the file
+ *
+ */
+OUFILE* oufs_fopen(char * cwd, char * path, char * mode) {
+
+	// Check the mode
+	if (strcmp(mode, "r") && strcmp(mode, "w") && strcmp(mode, "a")) {
+		fprintf(stderr, "Unknown mode '%s'\n", mode);
+		return NULL;
+	}
+
+	INODE_REFERENCE parent_inode_ref, child_inode_ref;
+	char file_name[LONG_NAME_SIZE];
+	int found = oufs_resolve_path(cwd, path, &parent_inode_ref, &child_inode_ref, file_name);
+	if (found < 0) return NULL;
+
+	INODE inode;
+	BLOCK block_0;
+
+	if (found == 0) {
+
+		// Reading requires an existing file
+		if (mode[0] == 'r') {
+			fprintf(stderr, "File does not exist\n");
+			return NULL;
+		}
+
+		// The containing directory is the last thing that was found
+		parent_inode_ref = child_inode_ref;
+
+		// Check to see if parent can fit the new file
+		INODE parent_inode;
+		if (oufs_read_inode_by_reference(parent_inode_ref, &parent_inode) < 0) return NULL;
+		if (parent_inode.type != IT_DIRECTORY) {
+			fprintf(stderr, "Improper path name %s\n", path);
+			return NULL;
+		}
+		int n_entries = oufs_name_entries(strlen(file_name));
+		if (parent_inode.size + n_entries > DIRECTORY_ENTRIES_PER_BLOCK) {
+			fprintf(stderr, "Not enough space in parent\n");
+			return NULL;
+		}
+
+		// Allocate the inode
+		int inode_ref;
+		if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return NULL;
+		if (oufs_find_bit_positions(block_0.master.inode_allocated_flag, &inode_ref, 'I') < 0) return NULL;
+		child_inode_ref = inode_ref;
+
+		if (block_0.master.feature_flags & FEATURE_SUBTREE_COUNTERS)
+			if (oufs_update_subtree_counters(&block_0, parent_inode_ref, 1, 0, 0) < 0) return NULL;
+		if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return NULL;
+
+		// Empty file inode
+		inode.type = IT_FILE;
+		inode.n_references = 1;
+		for (int i = 0; i < BLOCKS_PER_INODE; i++)
+			inode.data[i] = UNALLOCATED_BLOCK;
+		inode.size = 0;
+		if (oufs_write_inode_by_reference(child_inode_ref, &inode) < 0) return NULL;
+
+		// Add it to the parent
+		parent_inode.size += n_entries;
+		if (oufs_write_inode_by_reference(parent_inode_ref, &parent_inode) < 0) return NULL;
+
+		BLOCK parent_dir_block;
+		if (vdisk_read_block(parent_inode.data[0], &parent_dir_block) < 0) return NULL;
+		oufs_directory_add(&parent_dir_block, file_name, child_inode_ref);
+		if (vdisk_write_block(parent_inode.data[0], &parent_dir_block) < 0) return NULL;
+		if (oufs_bloom_update(parent_inode_ref, file_name) < 0) return NULL;
+
+	} else {
+
+		// Only files can be opened
+		if (oufs_read_inode_by_reference(child_inode_ref, &inode) < 0) return NULL;
+		if (inode.type != IT_FILE) {
+			fprintf(stderr, "%s is not a file\n", path);
+			return NULL;
+		}
+
+		// Truncate: release all data blocks
+		if (mode[0] == 'w' && inode.size > 0) {
+			if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return NULL;
+
+			int n_blocks = 0;
+			for (int i = 0; i < BLOCKS_PER_INODE; i++) {
+				if (inode.data[i] != UNALLOCATED_BLOCK) {
+					block_0.master.block_allocated_flag[inode.data[i] >> 3] &= ~(1 << (inode.data[i] & 7));
+					inode.data[i] = UNALLOCATED_BLOCK;
+					n_blocks++;
+				}
+			}
+
+			if (block_0.master.feature_flags & FEATURE_SUBTREE_COUNTERS)
+				if (oufs_update_subtree_counters(&block_0, parent_inode_ref, 0, -n_blocks, -(int) inode.size) < 0) return NULL;
+			if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return NULL;
+
+			inode.size = 0;
+			if (oufs_write_inode_by_reference(child_inode_ref, &inode) < 0) return NULL;
+		}
+	}
+
+	// Take an OUFILE from the pool
+	if (n_free_files < 0) {
+		for (n_free_files = 0; n_free_files < OUFS_MAX_OPEN_FILES; n_free_files++)
+			free_files[n_free_files] = &file_pool[OUFS_MAX_OPEN_FILES - 1 - n_free_files];
+	}
+	if (n_free_files == 0) {
+		fprintf(stderr, "Too many open files\n");
+		return NULL;
+	}
+	OUFILE * fp = free_files[--n_free_files];
+	fp->inode_reference = child_inode_ref;
+	fp->mode = mode[0];
+	fp->offset = mode[0] == 'r' ? 0 : inode.size;
+
+	FILE_STATE * state = &file_state[fp - file_pool];
+	state->in_use = 1;
+	state->advice = OUFS_FADV_NORMAL;
+	state->ring_count = 0;
+
+	// Share the in-memory inode with any other OUFILE on this file
+	OPEN_INODE * entry = &open_inode[child_inode_ref];
+	if (entry->n_open++ == 0) {
+		entry->inode = inode;
+		entry->dirty = 0;
+		entry->parent = parent_inode_ref;
+	}
+
+	return fp;
+}
+
+/**
+ * Close an open file. When the last OUFILE on a file is closed, its
+ * inode is written back to the disk if it has changed.
+ *
+ * @param fp Open file
+ *
+ */
+void oufs_fclose(OUFILE * fp) {
+
+	OPEN_INODE * entry = &open_inode[fp->inode_reference];
+	if (entry->n_open == 1 && entry->dirty) {
+		if (oufs_write_inode_by_reference(fp->inode_reference, &entry->inode) < 0)
+			fprintf(stderr, "oufs_fclose(): unable to write inode %d\n", fp->inode_reference);
+	}
+	entry->n_open--;
+
+	// Back to the pool
+	file_state[fp - file_pool].in_use = 0;
+	free_files[n_free_files++] = fp;
+}
+
+// Position within a list of caller buffers
+typedef struct iov_cursor_s
+{
+	const struct iovec * iov;
+	int index;
+	size_t offset;
+} IOV_CURSOR;
+
+/**
+ * Advance a cursor by n bytes. Each piece passed over is either appended
+ * to pieces (when pieces is not NULL) or copied to/from buf (when buf is
+ * not NULL).
+ *
+ * @param cursor Position in the caller's buffers
+ * @param n Number of bytes to advance
+ * @param pieces Array to append the caller's memory to, or NULL
+ * @param n_pieces Number of entries already in pieces; updated
+ * @param buf Bytes to copy, or NULL
+ * @param to_caller Nonzero to copy from buf into the caller's buffers
+ *
+ */
+void oufs_iov_advance(IOV_CURSOR * cursor, size_t n, struct iovec * pieces, int * n_pieces, unsigned char * buf, int to_caller) {
+
+	while (n > 0) {
+		const struct iovec * current = &cursor->iov[cursor->index];
+		size_t available = current->iov_len - cursor->offset;
+		if (available == 0) {
+			cursor->index++;
+			cursor->offset = 0;
+			continue;
+		}
+
+		size_t step = MIN(n, available);
+		unsigned char * base = (unsigned char *) current->iov_base + cursor->offset;
+		if (pieces) {
+			pieces[*n_pieces].iov_base = base;
+			pieces[(*n_pieces)++].iov_len = step;
+		} else if (buf) {
+			if (to_caller)
+				memcpy(base, buf, step);
+			else
+				memcpy(buf, base, step);
+			buf += step;
+		}
+
+		cursor->offset += step;
+		n -= step;
+	}
+}
+
+/**
+ * Move bytes between a byte range of a file and a list of caller buffers.
+ * The whole range is mapped to blocks once, and every run of consecutive
+ * disk blocks is moved with one vectored vdisk request. Blocks that the
+ * range covers completely go straight to or from the caller's memory;
+ * only the partial first and last blocks pass through a bounce buffer.
+ *
+ * Reads keep the blocks in the block cache unless the file has been
+ * advised OUFS_FADV_NOREUSE.
+ *
+ * @param fp Open file to transfer
+ * @param iov Caller buffers, filled or drained in order
+ * @param iovcnt Number of caller buffers
+ * @param offset Byte offset in the file (< 0 to append at the end)
+ * @param write Nonzero to write to the file, zero to read from it
+ *
+ * @return Number of bytes transferred
+ *       < 0 Error transferring
+ *
+ */
+int oufs_transfer(OUFILE * fp, const struct iovec * iov, int iovcnt, int offset, int write) {
+
+	INODE_REFERENCE inode_ref = fp->inode_reference;
+	int cache_flags = file_state[fp - file_pool].advice == OUFS_FADV_NOREUSE ? VDISK_NOCACHE : 0;
+
+	INODE inode;
+	if (oufs_read_inode_by_reference(inode_ref, &inode) < 0) return -1;
+	unsigned int old_size = inode.size;
+
+	if (offset < 0) offset = inode.size;
+	if (offset > (int) inode.size) {
+		fprintf(stderr, "Offset %d is past the end of the file\n", offset);
+		return -1;
+	}
+
+	// Bytes requested, limited to what the file holds or can hold
+	long total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	total = MIN(total, (long) (write ? BLOCKS_PER_INODE * BLOCK_SIZE : inode.size) - offset);
+	if (total <= 0) return 0;
+
+	// Allocate any blocks that writing past the end needs, from an in-memory
+	//  master block that is written back once
+	BLOCK block_0;
+	int new_block[BLOCKS_PER_INODE] = { 0 };
+	int n_new_blocks = 0;
+	if (write) {
+		if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return -1;
+		for (int i = offset / BLOCK_SIZE; i <= (offset + total - 1) / BLOCK_SIZE; i++) {
+			if (inode.data[i] != UNALLOCATED_BLOCK) continue;
+
+			int block_ref;
+			if (oufs_find_bit_positions(block_0.master.block_allocated_flag, &block_ref, 'B') < 0) {
+				// Disk is full: write what fits
+				total = i * BLOCK_SIZE - offset;
+				break;
+			}
+			inode.data[i] = block_ref;
+			new_block[i] = 1;
+			n_new_blocks++;
+		}
+	}
+
+	// Move each run of consecutive disk blocks with one request
+	IOV_CURSOR cursor = { iov, 0, 0 };
+	int first = offset / BLOCK_SIZE;
+	int last = total > 0 ? (offset + total - 1) / BLOCK_SIZE : first - 1;
+	for (int run = first; run <= last; ) {
+		int run_end = run;
+		while (run_end < last && inode.data[run_end + 1] == inode.data[run_end] + 1)
+			run_end++;
+
+		struct iovec pieces[(run_end - run + 1) + iovcnt + 2];
+		int n_pieces = 0;
+		BLOCK bounce[2];
+		IOV_CURSOR bounce_cursor[2];
+		int bounce_lo[2], bounce_hi[2];
+		int n_bounce = 0;
+
+		for (int i = run; i <= run_end; i++) {
+			// Part of this block inside the range
+			int lo = MAX(offset, i * BLOCK_SIZE) - i * BLOCK_SIZE;
+			int hi = MIN(offset + total, (i + 1) * BLOCK_SIZE) - i * BLOCK_SIZE;
+
+			if (lo == 0 && hi == BLOCK_SIZE) {
+				// Whole block: caller memory
+				oufs_iov_advance(&cursor, BLOCK_SIZE, pieces, &n_pieces, NULL, 0);
+				continue;
+			}
+
+			// Partial block: bounce buffer
+			BLOCK * b = &bounce[n_bounce];
+			bounce_cursor[n_bounce] = cursor;
+			bounce_lo[n_bounce] = lo;
+			bounce_hi[n_bounce++] = hi;
+			if (write) {
+				// Keep the bytes outside the range
+				if (new_block[i])
+					memset(b, 0, sizeof(BLOCK));
+				else if (vdisk_read_block(inode.data[i], b) < 0) return -1;
+				oufs_iov_advance(&cursor, hi - lo, NULL, NULL, b->data.data + lo, 0);
+			} else {
+				oufs_iov_advance(&cursor, hi - lo, NULL, NULL, NULL, 0);
+			}
+			pieces[n_pieces].iov_base = b;
+			pieces[n_pieces++].iov_len = BLOCK_SIZE;
+		}
+
+		if (write) {
+			if (vdisk_writev_blocks(inode.data[run], pieces, n_pieces) < 0) return -1;
+		} else {
+			if (vdisk_readv_blocks(inode.data[run], pieces, n_pieces, cache_flags) < 0) return -1;
+
+			// Hand the partial blocks to the caller
+			for (int i = 0; i < n_bounce; i++)
+				oufs_iov_advance(&bounce_cursor[i], bounce_hi[i] - bounce_lo[i], NULL, NULL,
+						bounce[i].data.data + bounce_lo[i], 1);
+		}
+
+		run = run_end + 1;
+	}
+
+	if (write) {
+		inode.size = MAX(inode.size, (unsigned int) (offset + total));
+
+		// Readahead rings on this file may now be stale
+		for (int i = 0; i < OUFS_MAX_OPEN_FILES; i++)
+			if (file_state[i].in_use && file_pool[i].inode_reference == inode_ref)
+				file_state[i].ring_count = 0;
+
+		// Master block changes if blocks were allocated or it holds counters
+		int counters = block_0.master.feature_flags & FEATURE_SUBTREE_COUNTERS;
+		if (counters && oufs_update_subtree_counters(&block_0, open_inode[inode_ref].parent, 0, n_new_blocks, inode.size - old_size) < 0) return -1;
+		if ((n_new_blocks > 0 || counters) && vdisk_write_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return -1;
+		if (inode.size != old_size || n_new_blocks > 0)
+			if (oufs_store_inode(inode_ref, &inode) < 0) return -1;
+	}
+
+	return total;
+}
+
+/**
+ * Read for a sequential reader. Blocks come from the file's readahead
+ * ring; when the ring runs out it is refilled with the next
+ * OUFS_READAHEAD_BLOCKS blocks (as far as they are consecutive on the
+ * disk) in one request that bypasses the block cache.
+ *
+ * @param fp Open file advised OUFS_FADV_SEQUENTIAL
+ * @param inode Inode of the file
+ * @param iov Buffers for the bytes read
+ * @param iovcnt Number of buffers
+ * @param offset Byte offset in the file to read from
+ *
+ * @return Number of bytes read
+ *       < 0 Error reading the file
+ *
+ */
+int oufs_read_ahead(OUFILE * fp, INODE * inode, const struct iovec * iov, int iovcnt, int offset) {
+
+	FILE_STATE * state = &file_state[fp - file_pool];
+
+	long total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	total = MIN(total, (long) inode->size - offset);
+
+	IOV_CURSOR cursor = { iov, 0, 0 };
+	for (long done = 0; done < total; ) {
+		int index = (offset + done) / BLOCK_SIZE;
+
+		// Refill the ring from this block on
+		if (index < state->ring_start || index >= state->ring_start + state->ring_count) {
+			int n = 1;
+			while (n < OUFS_READAHEAD_BLOCKS && (index + n) * BLOCK_SIZE < (int) inode->size
+					&& inode->data[index + n] == inode->data[index + n - 1] + 1)
+				n++;
+
+			struct iovec ring = { state->ring, n * BLOCK_SIZE };
+			state->ring_count = 0;
+			if (vdisk_readv_blocks(inode->data[index], &ring, 1, VDISK_NOCACHE) < 0) return -1;
+			state->ring_start = index;
+			state->ring_count = n;
+		}
+
+		int lo = (offset + done) % BLOCK_SIZE;
+		int n = MIN(BLOCK_SIZE - lo, total - done);
+		oufs_iov_advance(&cursor, n, NULL, NULL, state->ring[index - state->ring_start].data.data + lo, 1);
+		done += n;
+	}
+
+	return total;
+}
+
+/**
+ * Tell the library how a range of an open file will be used.
+ *
+ * OUFS_FADV_NORMAL, OUFS_FADV_RANDOM: reads go through the block cache
+ * OUFS_FADV_SEQUENTIAL: reads use the file's own readahead ring and leave
+ *   the block cache alone
+ * OUFS_FADV_NOREUSE: reads bypass the block cache, without readahead
+ * OUFS_FADV_WILLNEED: read the range into the block cache now
+ * OUFS_FADV_DONTNEED: drop the range from the block cache
+ *
+ * @param fp Open file
+ * @param offset Byte offset of the range
+ * @param len Length of the range (0 for the rest of the file)
+ * @param advice OUFS_FADV_*
+ *
+ * @return 0 Advice applied
+ *       < 0 Unknown advice or error reading the file
+ *
+ */
+int oufs_fadvise(OUFILE * fp, int offset, int len, int advice) {
+
+	FILE_STATE * state = &file_state[fp - file_pool];
+
+	switch (advice) {
+	case OUFS_FADV_NORMAL:
+	case OUFS_FADV_RANDOM:
+	case OUFS_FADV_SEQUENTIAL:
+	case OUFS_FADV_NOREUSE:
+		// Access pattern: applies to the whole handle
+		state->advice = advice;
+		state->ring_count = 0;
+		return 0;
+	case OUFS_FADV_WILLNEED:
+	case OUFS_FADV_DONTNEED:
+		break;
+	default:
+		fprintf(stderr, "oufs_fadvise(): unknown advice %d\n", advice);
+		return -1;
+	}
+
+	INODE inode;
+	if (oufs_read_inode_by_reference(fp->inode_reference, &inode) < 0) return -1;
+	if (offset < 0 || offset >= (int) inode.size) return 0;
+	if (len <= 0 || len > (int) inode.size - offset) len = inode.size - offset;
+
+	if (advice == OUFS_FADV_DONTNEED)
+		state->ring_count = 0;
+
+	// Work on each run of consecutive disk blocks in the range
+	int last = (offset + len - 1) / BLOCK_SIZE;
+	for (int run = offset / BLOCK_SIZE; run <= last; ) {
+		int run_end = run;
+		while (run_end < last && inode.data[run_end + 1] == inode.data[run_end] + 1)
+			run_end++;
+
+		if (advice == OUFS_FADV_WILLNEED) {
+			if (vdisk_cache_prefetch(inode.data[run], run_end - run + 1) < 0) return -1;
+		} else {
+			if (vdisk_cache_drop(inode.data[run], run_end - run + 1) < 0) return -1;
+		}
+
+		run = run_end + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Append bytes to the end of an open file. Writing stops early if the
+ * file reaches BLOCKS_PER_INODE blocks or the disk fills up.
+ *
+ * @param fp File opened with "w" or "a"
+ * @param buf Bytes to write
+ * @param len Number of bytes to write
+ *
+ * @return Number of bytes written
+ *       < 0 Error writing the file
+ *
+ */
+int oufs_fwrite(OUFILE * fp, unsigned char * buf, int len) {
+	struct iovec iov = { buf, len };
+	return oufs_fwritev(fp, &iov, 1);
+}
+
+/**
+ * Read bytes from the current offset of an open file.
+ *
+ * @param fp File opened with "r"
+ * @param buf Buffer for the bytes read
+ * @param len Most bytes to read
+ *
+ * @return Number of bytes read (0 at the end of the file)
+ *       < 0 Error reading the file
+ *
+ */
+int oufs_fread(OUFILE * fp, unsigned char * buf, int len) {
+	struct iovec iov = { buf, len };
+	return oufs_freadv(fp, &iov, 1);
+}
+
+/**
+ * Append the contents of several buffers, in order, to the end of an
+ * open file.
+ *
+ * @param fp File opened with "w" or "a"
+ * @param iov Buffers to write
+ * @param iovcnt Number of buffers
+ *
+ * @return Number of bytes written
+ *       < 0 Error writing the file
+ *
+ */
+int oufs_fwritev(OUFILE * fp, const struct iovec * iov, int iovcnt) {
+
+	if (fp->mode == 'r') {
+		fprintf(stderr, "File is not open for writing\n");
+		return -1;
+	}
+
+	int written = oufs_transfer(fp, iov, iovcnt, -1, 1);
+	if (written > 0) fp->offset += written;
+	return written;
+}
+
+/**
+ * Read from the current offset of an open file into several buffers,
+ * filling them in order.
+ *
+ * @param fp File opened with "r"
+ * @param iov Buffers for the bytes read
+ * @param iovcnt Number of buffers
+ *
+ * @return Number of bytes read (0 at the end of the file)
+ *       < 0 Error reading the file
+ *
+ */
+int oufs_freadv(OUFILE * fp, const struct iovec * iov, int iovcnt) {
+
+	int n_read = oufs_preadv(fp, iov, iovcnt, fp->offset);
+	if (n_read > 0) fp->offset += n_read;
+	return n_read;
+}
+
+/**
+ * Read from a given offset of an open file into several buffers. The
+ * file's own offset is not used or changed.
+ *
+ * @param fp File opened with "r"
+ * @param iov Buffers for the bytes read
+ * @param iovcnt Number of buffers
+ * @param offset Byte offset in the file to read from
+ *
+ * @return Number of bytes read (0 at or past the end of the file)
+ *       < 0 Error reading the file
+ *
+ */
+int oufs_preadv(OUFILE * fp, const struct iovec * iov, int iovcnt, int offset) {
+
+	if (fp->mode != 'r') {
+		fprintf(stderr, "File is not open for reading\n");
+		return -1;
+	}
+
+	INODE inode;
+	if (oufs_read_inode_by_reference(fp->inode_reference, &inode) < 0) return -1;
+	if (offset >= (int) inode.size) return 0;
+
+	if (file_state[fp - file_pool].advice == OUFS_FADV_SEQUENTIAL)
+		return oufs_read_ahead(fp, &inode, iov, iovcnt, offset);
+
+	return oufs_transfer(fp, iov, iovcnt, offset, 0);
+}
+
+/**
+ * Write several buffers at a given offset of an open file, overwriting
+ * what is there and growing the file if needed. The offset may be at most
+ * the file size. The file's own offset is not used or changed.
+ *
+ * @param fp File opened with "w" or "a"
+ * @param iov Buffers to write
+ * @param iovcnt Number of buffers
+ * @param offset Byte offset in the file to write at
+ *
+ * @return Number of bytes written
+ *       < 0 Error writing the file
+ *
+ */
+int oufs_pwritev(OUFILE * fp, const struct iovec * iov, int iovcnt, int offset) {
+
+	if (fp->mode == 'r') {
+		fprintf(stderr, "File is not open for writing\n");
+		return -1;
+	}
+
+	return oufs_transfer(fp, iov, iovcnt, offset, 1);
+}
+
+/**
+ * Read bytes from a given offset of an open file without using or
+ * changing the file's own offset.
+ *
+ * @param fp File opened with "r"
+ * @param buf Buffer for the bytes read
+ * @param len Most bytes to read
+ * @param offset Byte offset in the file to read from
+ *
+ * @return Number of bytes read
+ *       < 0 Error reading the file
+ *
+ */
+int oufs_pread(OUFILE * fp, unsigned char * buf, int len, int offset) {
+	struct iovec iov = { buf, len };
+	return oufs_preadv(fp, &iov, 1, offset);
+}
+
+/**
+ * Write bytes at a given offset of an open file without using or
+ * changing the file's own offset.
+ *
+ * @param fp File opened with "w" or "a"
+ * @param buf Bytes to write
+ * @param len Number of bytes to write
+ * @param offset Byte offset in the file to write at
+ *
+ * @return Number of bytes written
+ *       < 0 Error writing the file
+ *
+ */
+int oufs_pwrite(OUFILE * fp, unsigned char * buf, int len, int offset) {
+	struct iovec iov = { buf, len };
+	return oufs_pwritev(fp, &iov, 1, offset);
+}
+
+/**
+ * Copy part of an open file straight to a host file descriptor. Each run
+ * of consecutive disk blocks is sent by the kernel from the virtual disk
+ * with one request, so the bytes never pass through a user buffer. The
+ * file's own offset is not used or changed.
+ *
+ * @param fp Open file
+ * @param host_fd Host descriptor to write to
+ * @param offset Byte offset in the file to start from
+ * @param len Most bytes to send (< 0 for the rest of the file)
+ *
+ * @return Number of bytes sent
+ *       < 0 Error sending
+ *
+ */
+int oufs_sendfile(OUFILE * fp, int host_fd, int offset, int len) {
+
+	INODE inode;
+	if (oufs_read_inode_by_reference(fp->inode_reference, &inode) < 0) return -1;
+
+	// Limit to the bytes the file holds
+	if (offset < 0 || offset >= (int) inode.size) return 0;
+	if (len < 0 || len > (int) inode.size - offset) len = inode.size - offset;
+
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + len - 1) / BLOCK_SIZE;
+	for (int run = first; run <= last; ) {
+		int run_end = run;
+		while (run_end < last && inode.data[run_end + 1] == inode.data[run_end] + 1)
+			run_end++;
+
+		// Bytes of the range held by this run
+		int lo = MAX(offset, run * BLOCK_SIZE);
+		int hi = MIN(offset + len, (run_end + 1) * BLOCK_SIZE);
+		if (vdisk_sendfile(host_fd, inode.data[run], lo - run * BLOCK_SIZE, hi - lo) < 0) return -1;
+
+		run = run_end + 1;
+	}
+
+	return len;
+}
+
+/**
+ * Allocate data blocks in an in-memory master block, preferring a single
+ * run of consecutive blocks. If no run is long enough, the lowest free
+ * blocks are taken instead.
+ *
+ * @param master Master block to allocate from
+ * @param n Number of blocks wanted
+ * @param refs Array of n block references to fill in
+ *
+ * @return Number of blocks allocated (less than n if the disk is full)
+ *
+ */
+int oufs_allocate_blocks(BLOCK * master, int n, BLOCK_REFERENCE * refs) {
+
+	unsigned char * flags = master->master.block_allocated_flag;
+
+	// Look for n free blocks in a row
+	for (int start = 0, length = 0, i = 0; n > 0 && i < N_BLOCKS_IN_DISK; i++) {
+		if (flags[i >> 3] & (1 << (i & 7))) {
+			length = 0;
+			continue;
+		}
+		if (length++ == 0) start = i;
+		if (length == n) {
+			for (int j = 0; j < n; j++) {
+				refs[j] = start + j;
+				flags[(start + j) >> 3] |= 1 << ((start + j) & 7);
+			}
+			return n;
+		}
+	}
+
+	// Fragmented: take them one at a time
+	int allocated = 0;
+	for (int i = 0; allocated < n && i < N_BLOCKS_IN_DISK; i++) {
+		if (!(flags[i >> 3] & (1 << (i & 7)))) {
+			refs[allocated++] = i;
+			flags[i >> 3] |= 1 << (i & 7);
+		}
+	}
+	return allocated;
+}
+
+/**
+ * Fill an empty open file with size bytes from a host descriptor, for
+ * oufs_import_fd().
+ *
+ * @param fp Empty file opened with "w"
+ * @param host_fd Host descriptor to read from
+ * @param size Number of bytes to import
+ *
+ * @return Number of bytes imported
+ *       < 0 Error importing
+ *
+ */
+int oufs_import_blocks(OUFILE * fp, int host_fd, long size) {
+
+	if (size == 0) return 0;
+
+	// Allocate every block the file needs in one pass
+	INODE inode;
+	BLOCK block_0;
+	int n_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+	if (oufs_read_inode_by_reference(fp->inode_reference, &inode) < 0) return -1;
+	if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return -1;
+	if (oufs_allocate_blocks(&block_0, n_blocks, refs) < n_blocks) {
+		fprintf(stderr, "Not enough available blocks\n");
+		return -1;
+	}
+
+	// Clear the last block so nothing stale follows the end of the file
+	BLOCK empty_block;
+	memset(&empty_block, 0, sizeof(empty_block));
+	if (size % BLOCK_SIZE && vdisk_write_block(refs[n_blocks - 1], &empty_block) < 0) return -1;
+
+	// Fill each run of consecutive blocks with one copy
+	for (int run = 0; run < n_blocks; ) {
+		int run_end = run;
+		while (run_end + 1 < n_blocks && refs[run_end + 1] == refs[run_end] + 1)
+			run_end++;
+
+		int len = MIN(size, (long) (run_end + 1) * BLOCK_SIZE) - run * BLOCK_SIZE;
+		if (vdisk_import(host_fd, refs[run], len) < 0) return -1;
+
+		run = run_end + 1;
+	}
+
+	// Publish the blocks only once they hold the data
+	for (int i = 0; i < n_blocks; i++)
+		inode.data[i] = refs[i];
+	inode.size = size;
+
+	if (block_0.master.feature_flags & FEATURE_SUBTREE_COUNTERS)
+		if (oufs_update_subtree_counters(&block_0, open_inode[fp->inode_reference].parent, 0, n_blocks, size) < 0) return -1;
+	if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &block_0) < 0) return -1;
+	if (oufs_store_inode(fp->inode_reference, &inode) < 0) return -1;
+
+	return size;
+}
+
+/**
+ * Given a cwd and a path, create (or replace) a file holding everything
+ * from the current position of a host file descriptor to its end. When
+ * the host size is known, all blocks are allocated up front, preferably
+ * as one run, and each run is filled by the kernel straight from the host
+ * file. Otherwise the data is appended in large buffered writes.
+ *
+ * @param cwd Current working directory
+ * @param path Path of the file to create
+ * @param host_fd Host descriptor to read from
+ *
+ * @return Number of bytes imported
+ *       < 0 Error importing
+ *
+ */
+int oufs_import_fd(char * cwd, char * path, int host_fd) {
+
+	// How much is left to read?
+	struct stat st;
+	off_t position = lseek(host_fd, 0, SEEK_CUR);
+	int known_size = fstat(host_fd, &st) == 0 && S_ISREG(st.st_mode) && position >= 0;
+	long size = known_size ? st.st_size - position : 0;
+	if (size > BLOCKS_PER_INODE * BLOCK_SIZE) {
+		fprintf(stderr, "File too large (%ld bytes)\n", size);
+		return -1;
+	}
+
+	if (!known_size) {
+		// Unknown size (pipe, terminal, ...): read it all, then write it
+		unsigned char buf[BLOCKS_PER_INODE * BLOCK_SIZE];
+		int total = 0;
+		ssize_t n = 0;
+		while (total < (int) sizeof(buf) && (n = read(host_fd, buf + total, sizeof(buf) - total)) > 0)
+			total += n;
+
+		// A full buffer must also be the end of the input
+		unsigned char extra;
+		if (n < 0 || (total == (int) sizeof(buf) && (n = read(host_fd, &extra, 1)) != 0)) {
+			if (n < 0)
+				fprintf(stderr, "Unable to read input\n");
+			else
+				fprintf(stderr, "File too large (more than %d bytes)\n", total);
+			return -1;
+		}
+
+		OUFILE * fp = oufs_fopen(cwd, path, "w");
+		if (!fp) return -1;
+		int written = oufs_fwrite(fp, buf, total);
+		oufs_fclose(fp);
+		return written;
+	}
+
+	OUFILE * fp = oufs_fopen(cwd, path, "w");
+	if (!fp) return -1;
+
+	int ret = oufs_import_blocks(fp, host_fd, size);
+	oufs_fclose(fp);
+	return ret;
+}
+
+/**
+ * Map the whole of an open file read-only into memory. If the file's
+ * blocks are consecutive on the disk, the result points straight into a
+ * mapping of the virtual disk. Otherwise the blocks are assembled into a
+ * private mapping, which is then made read-only.
+ *
+ * @param fp Open file
+ * @param map Filled in with the mapping
+ *
+ * @return 0 Successfully mapped the file
+ *       < 0 Error mapping the file
+ *
+ */
+int oufs_mmap(OUFILE * fp, OUFS_MAPPING * map) {
+
+	memset(map, 0, sizeof(OUFS_MAPPING));
+
+	INODE inode;
+	if (oufs_read_inode_by_reference(fp->inode_reference, &inode) < 0) return -1;
+	if (inode.size == 0) return 0;
+
+	// Contiguous?
+	int n_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int contiguous = 1;
+	for (int i = 1; i < n_blocks; i++)
+		if (inode.data[i] != inode.data[i - 1] + 1) contiguous = 0;
+
+	if (contiguous) {
+		map->data = vdisk_map(inode.data[0], n_blocks, &map->base, &map->base_len);
+		if (!map->data) return -1;
+		map->len = inode.size;
+		return 0;
+	}
+
+	// Fragmented: assemble a private copy
+	map->base_len = inode.size;
+	map->base = mmap(NULL, map->base_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map->base == MAP_FAILED) {
+		fprintf(stderr, "oufs_mmap(): mmap failed\n");
+		memset(map, 0, sizeof(OUFS_MAPPING));
+		return -1;
+	}
+
+	struct iovec iov = { map->base, inode.size };
+	if (oufs_transfer(fp, &iov, 1, 0, 0) != (int) inode.size || mprotect(map->base, map->base_len, PROT_READ) < 0) {
+		oufs_munmap(map);
+		return -1;
+	}
+
+	map->data = map->base;
+	map->len = inode.size;
+	return 0;
+}
+
+/**
+ * Release a mapping made by oufs_mmap().
+ *
+ * @param map Mapping to release
+ *
+ */
+void oufs_munmap(OUFS_MAPPING * map) {
+	if (map->base) munmap(map->base, map->base_len);
+	memset(map, 0, sizeof(OUFS_MAPPING));
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# A .. may only back out of a directory that exists.
+
+cd "$(dirname "$0")/.." || exit 1
+ZDISK=$(mktemp /tmp/oufs-test.XXXXXX) || exit 1
+ZPWD=/
+export ZDISK ZPWD
+trap 'rm -f "$ZDISK" "$ZDISK".* /tmp/oufs-test-$$' EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+./zformat || fail "zformat"
+./zmkdir a || fail "zmkdir a"
+./zmkdir a/b || fail "zmkdir a/b"
+echo hello > /tmp/oufs-test-$$
+./zput /tmp/oufs-test-$$ file1 || fail "zput"
+
+./zmkdir nope/../q 2>/dev/null
+./zfilez | grep -qx q/ && fail "nope/../q made"
+./zfilez file1/.. 2>&1 | grep -q "Improper path name" || fail "file1/.. resolved"
+./zcd a/nope/.. >/dev/null 2>&1 && fail "zcd a/nope/.."
+
+./zmkdir a/b/../c || fail "zmkdir a/b/../c"
+./zfilez a | grep -qx c/ || fail "c not in a"
+[ "$(ZPWD=/a/b ./zfilez ../.. | tr '\n' ' ')" = "./ ../ a/ file1 " ] || fail "../.. from /a/b"
+./zfsck || fail "zfsck"
+
+echo "PASS: dot dot"
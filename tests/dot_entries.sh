@@ -0,0 +1,27 @@
+#!/bin/sh
+# . and .. stay in slots 0 and 1 of a sorted directory, even next to
+# names that sort before them.
+
+cd "$(dirname "$0")/.." || exit 1
+ZDISK=$(mktemp /tmp/oufs-test.XXXXXX) || exit 1
+ZPWD=/
+export ZDISK ZPWD
+trap 'rm -f "$ZDISK" "$ZDISK".*' EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+./zformat || fail "zformat"
+for d in '#x' +a -a b; do
+	./zmkdir "$d" || fail "zmkdir $d"
+done
+
+./zinspect -dblock 9 | grep -q 'Entry 0: name=".", inode=0' || fail ". moved"
+./zinspect -dblock 9 | grep -q 'Entry 1: name="..", inode=0' || fail ".. moved"
+[ "$(./zfilez | tr '\n' ' ')" = './ ../ #x/ +a/ -a/ b/ ' ] || fail "listing order"
+./zfilez '#x' | grep -qx ../ || fail "#x/.. not found"
+./zfsck || fail "zfsck"
+
+echo "PASS: dot entries"
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Names longer than one directory entry take continuation entries, and
+# take room in the directory to match.
+
+cd "$(dirname "$0")/.." || exit 1
+ZDISK=$(mktemp /tmp/oufs-test.XXXXXX) || exit 1
+ZPWD=/
+export ZDISK ZPWD
+trap 'rm -f "$ZDISK" "$ZDISK".* /tmp/oufs-test-$$' EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+LONG=abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRST
+
+./zformat || fail "zformat"
+./zmkdir $LONG || fail "zmkdir 56 characters"
+./zmkdir ${LONG}X 2>/dev/null
+./zfilez | grep -q "${LONG}X" && fail "57 characters accepted"
+./zmkdir abcdefghijklmn || fail "zmkdir 14 characters"
+./zmkdir b || fail "zmkdir b"
+./zmkdir $LONG/child || fail "zmkdir under a long name"
+./zfilez $LONG | grep -q child || fail "child not listed"
+
+echo hello > /tmp/oufs-test-$$
+./zput /tmp/oufs-test-$$ this_is_a_long_file_name.txt || fail "zput"
+./zcat this_is_a_long_file_name.txt | grep -q hello || fail "zcat"
+
+# Listed in name order, whatever the length
+[ "$(./zfilez | tr '\n' ' ')" = "./ ../ abcdefghijklmn/ $LONG/ b/ this_is_a_long_file_name.txt " ] || fail "listing order"
+
+# . .. 1 + 4 + 1 + 2 entries: room for 6 more, so 2 more names of 3
+./zmkdir 123456789012345678901234567890a || fail "zmkdir first of 3"
+./zmkdir 123456789012345678901234567890b || fail "zmkdir second of 3"
+./zmkdir c 2>/dev/null
+./zfilez | grep -qx c/ && fail "directory overfilled"
+
+./zrmdir $LONG/child || fail "zrmdir child"
+./zrmdir $LONG || fail "zrmdir long name"
+./zmkdir c && ./zfilez | grep -qx c/ || fail "zmkdir after freeing entries"
+./zinspect -dblock 9 | grep -q "$LONG" && fail "removed name still present"
+./zfsck || fail "zfsck"
+
+echo "PASS: long names"
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Nothing can be made inside a file, and the file is left as it was.
+
+cd "$(dirname "$0")/.." || exit 1
+ZDISK=$(mktemp /tmp/oufs-test.XXXXXX) || exit 1
+ZPWD=/
+export ZDISK ZPWD
+trap 'rm -f "$ZDISK" "$ZDISK".* /tmp/oufs-test-$$' EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+./zformat || fail "zformat"
+printf 'hi\n' > /tmp/oufs-test-$$
+./zput /tmp/oufs-test-$$ file1 || fail "zput"
+
+./zmkdir file1/x 2>&1 | grep -q "Improper path name" || fail "zmkdir file1/x accepted"
+./zput /tmp/oufs-test-$$ file1/y 2>&1 | grep -q "Improper path name" || fail "zput file1/y accepted"
+./zcat file1 | cmp -s - /tmp/oufs-test-$$ || fail "file1 changed"
+./zfsck || fail "zfsck"
+
+echo "PASS: mkdir in file"
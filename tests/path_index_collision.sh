@@ -0,0 +1,29 @@
+#!/bin/sh
+# The paths /p491/x and /p510/x fold to the same path index key.  With the
+# index on, each must still resolve to its own directory.
+
+cd "$(dirname "$0")/.." || exit 1
+ZDISK=$(mktemp /tmp/oufs-test.XXXXXX) || exit 1
+ZPWD=/
+export ZDISK ZPWD
+trap 'rm -f "$ZDISK" "$ZDISK".*' EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+./zformat || fail "zformat"
+for d in p491 p491/x p510 p510/x p491/x/only; do
+	./zmkdir $d || fail "zmkdir $d"
+done
+./zfsck -r || fail "zfsck -r"
+
+./zfilez /p510/x | grep -q only && fail "/p510/x lists /p491/x"
+./zmkdir /p510/x/new || fail "zmkdir /p510/x/new"
+./zfilez /p510/x | grep -q new || fail "new not in /p510/x"
+./zfilez /p491/x | grep -q new && fail "new made in /p491/x"
+./zcd p510/x | grep -q "ZPWD_INODE=4:" || fail "zcd p510/x"
+./zfsck || fail "zfsck"
+
+echo "PASS: path index collision"
@@ -0,0 +1,28 @@
+#!/bin/sh
+# A writer whose disk was replaced by another writer's commit must fail,
+# not report success for changes that were never committed.
+
+cd "$(dirname "$0")/.." || exit 1
+ZDISK=$(mktemp /tmp/oufs-test.XXXXXX) || exit 1
+ZPWD=/
+export ZDISK ZPWD
+trap 'rm -f "$ZDISK" "$ZDISK".*' EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+./zformat || fail "zformat"
+
+# zput opens the disk, then waits for its input while zmkdir commits
+(sleep 1; echo data) | ./zput - f1 2>/dev/null &
+sleep 0.3
+./zmkdir d || fail "zmkdir d"
+wait $! && fail "zput succeeded on a replaced disk"
+
+./zfilez | grep -qx d/ || fail "d missing"
+./zfilez | grep -qx f1 && fail "f1 committed"
+./zfsck || fail "zfsck"
+
+echo "PASS: refused commit"
@@ -0,0 +1,25 @@
+#!/bin/sh
+# A directory name holding a quote comes back from zcd as one shell word,
+# and nothing in it is run by the eval.
+
+cd "$(dirname "$0")/.." || exit 1
+ZDISK=$(mktemp /tmp/oufs-test.XXXXXX) || exit 1
+ZPWD=/
+export ZDISK ZPWD
+trap 'rm -f "$ZDISK" "$ZDISK".*' EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+name="x';ran=1;'"
+./zformat || fail "zformat"
+./zmkdir "$name" || fail "zmkdir"
+
+out=$(./zcd "$name") || fail "zcd"
+eval "$out"
+[ -z "$ran" ] || fail "eval ran part of the name"
+[ "$ZPWD" = "/$name" ] || fail "ZPWD is $ZPWD"
+
+echo "PASS: zcd quotes"
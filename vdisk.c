@@ -1,4 +1,12 @@
+#define _GNU_SOURCE
 #include "vdisk.h"
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
 /*
  * Virtual disk implementation.
  *
@@ -14,6 +22,612 @@
 
 int vdisk_fd = 0;
 
+// Block cache.  Writes go straight through to the file, so the cache never
+// holds anything the file does not, unless write-back is turned on
+// (vdisk_cache_write_back()).  Writes to metadata blocks, or to all blocks,
+// are then only made in the cache, and the changed blocks are written at
+// close in block order.  With all blocks held back, a changed data block
+// that has to leave the cache takes every other changed block with it, so
+// the file still only sees sorted batches of writes.
+//
+// Blocks are split into two classes.  Metadata blocks have their own slots,
+// so no amount of file data can push them out.  Data blocks are admitted on
+// probation: a block read once waits in a small FIFO and is only moved to
+// the protected LRU if it is used again while there.  A long sequential
+// scan therefore only ever churns the probation slots
+#define CACHE_QUEUE_METADATA 0
+#define CACHE_QUEUE_PROBATION 1
+#define CACHE_QUEUE_PROTECTED 2
+
+// Data slots given to blocks on probation
+#define VDISK_CACHE_PROBATION_BLOCKS (VDISK_CACHE_BLOCKS / 4)
+
+typedef struct vdisk_cache_entry_s
+{
+	// Block held in this slot (-1 = empty)
+	int block_ref;
+
+	// Value of cache_clock when the block was last used
+	unsigned long last_use;
+
+	// CACHE_QUEUE_* the block is on
+	unsigned char queue;
+
+	// Changed since it was last written to the file
+	unsigned char dirty;
+
+	unsigned char data[BLOCK_SIZE];
+} VDISK_CACHE_ENTRY;
+
+#define N_CACHE_SLOTS (VDISK_CACHE_METADATA_BLOCKS + VDISK_CACHE_BLOCKS)
+
+// The cache, its statistics and the commit state are shared by every
+//  thread of the process, so each public vdisk_* call holds cache_mutex
+//  from start to end (VDISK_LOCK()).  It is recursive, since the calls
+//  use one another
+static pthread_mutex_t cache_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/**
+ * Take cache_mutex for VDISK_LOCK()
+ *
+ * @return The mutex, to be given back by vdisk_release()
+ */
+static pthread_mutex_t *vdisk_acquire()
+{
+	pthread_mutex_lock(&cache_mutex);
+	return(&cache_mutex);
+}
+
+/**
+ * Give back cache_mutex when the variable made by VDISK_LOCK() goes out
+ * of scope
+ *
+ * @param mutex Variable holding the mutex
+ */
+static void vdisk_release(pthread_mutex_t **mutex)
+{
+	pthread_mutex_unlock(*mutex);
+}
+
+// Hold cache_mutex until the enclosing block is left, by any return
+#define VDISK_LOCK() pthread_mutex_t *vdisk_held __attribute__((cleanup(vdisk_release))) = vdisk_acquire()
+
+static VDISK_CACHE_ENTRY cache[N_CACHE_SLOTS];
+static unsigned long cache_clock = 0;
+
+// Number of blocks on each queue
+static int queue_length[3];
+
+// Slot holding each block, plus one (0 = not cached)
+static unsigned char cache_slot[N_BLOCKS_IN_DISK];
+
+// VDISK_CACHE_DATA or VDISK_CACHE_METADATA for each block
+static unsigned char block_class[N_BLOCKS_IN_DISK];
+
+// Which writes are held until close (VDISK_WRITE_*)
+static int write_back = VDISK_WRITE_THROUGH;
+
+// Number of times each block has been read since the disk was opened
+static unsigned int access_count[N_BLOCKS_IN_DISK];
+
+// File the hot-block list is kept in ("" = none)
+static char hot_list_name[PATH_MAX];
+
+// Name of the open disk file
+static char disk_name[PATH_MAX];
+
+// Atomic commits (vdisk_cache_atomic()): changes go to a copy of the disk
+//  file, which replaces it at close.  shadowed is set once vdisk_fd refers
+//  to the copy; commit_failed once the copy cannot be made, so that later
+//  writes are refused too, or once a held-back change is lost, so that
+//  close refuses the disk that is missing it
+static int atomic = 0;
+static int shadowed = 0;
+static int commit_failed = 0;
+
+// Descriptor of <disk>.lock while this process holds it (-1 = not held).
+//  Only writers take it, and only to commit
+static int lock_fd = -1;
+
+/**
+ * Empty the block cache.  Block classes are kept
+ */
+static void vdisk_cache_reset()
+{
+	for(int i = 0; i < N_CACHE_SLOTS; ++i)
+		cache[i].block_ref = -1;
+	for(int i = 0; i < N_BLOCKS_IN_DISK; ++i)
+		cache_slot[i] = 0;
+	for(int i = 0; i < 3; ++i)
+		queue_length[i] = 0;
+	for(int i = 0; i < N_BLOCKS_IN_DISK; ++i)
+		access_count[i] = 0;
+	hot_list_name[0] = 0;
+}
+
+/**
+ * Set the class of a run of blocks.  Blocks that are already cached keep
+ * their slot until they are next replaced
+ *
+ * @param first Index of the first block
+ * @param n_blocks Number of blocks
+ * @param cache_class VDISK_CACHE_DATA or VDISK_CACHE_METADATA
+ */
+void vdisk_cache_set_class(BLOCK_REFERENCE first, int n_blocks, int cache_class)
+{
+	VDISK_LOCK();
+
+	for(int i = first; i < first + n_blocks && i < N_BLOCKS_IN_DISK; ++i)
+		block_class[i] = cache_class;
+}
+
+/**
+ * Find a cached block.  A data block found on probation has now been
+ * used twice, and is moved to the protected queue
+ *
+ * @param block_ref Index of the block
+ * @return The cache entry holding the block; NULL if it is not cached
+ */
+static VDISK_CACHE_ENTRY *vdisk_cache_lookup(BLOCK_REFERENCE block_ref)
+{
+	if(cache_slot[block_ref] == 0)
+		return(NULL);
+
+	VDISK_CACHE_ENTRY *entry = &cache[cache_slot[block_ref] - 1];
+	if(entry->queue == CACHE_QUEUE_PROBATION) {
+		queue_length[CACHE_QUEUE_PROBATION]--;
+		queue_length[CACHE_QUEUE_PROTECTED]++;
+		entry->queue = CACHE_QUEUE_PROTECTED;
+	}
+	entry->last_use = ++cache_clock;
+	return(entry);
+}
+
+/**
+ * Set which writes are held in the cache until close.  Holding back fewer
+ * writes than before writes out any blocks that are waiting
+ *
+ * @param mode VDISK_WRITE_THROUGH, VDISK_WRITE_BACK_METADATA or
+ *        VDISK_WRITE_BACK_ALL
+ * @return 0 on success; <0 on error
+ */
+int vdisk_cache_write_back(int mode)
+{
+	VDISK_LOCK();
+
+	int ret = 0;
+	if(mode < write_back && vdisk_fd != 0)
+		ret = vdisk_cache_flush();
+	write_back = mode;
+	return(ret);
+}
+
+/**
+ * Commit the changes made through this process atomically.  The first
+ * write to the file copies it to <disk>.new, and that copy takes all of
+ * the writes and reads from then on; write-back of all blocks keeps this
+ * to once per process in most cases.  At close the copy is synced and
+ * renamed over the disk file.  Until then, any other process that opens
+ * the disk sees it as it was before; a crash leaves it untouched.
+ *
+ * Each commit makes a new file, so the file a process opened is a
+ * snapshot of the disk: readers see one version throughout, take no
+ * locks and never hold up a writer.  Writers take <disk>.lock to make
+ * the copy and keep it until the rename.  A writer that finds the disk
+ * already replaced since it was opened has worked from an old version;
+ * its changes are refused rather than lost over the newer ones
+ *
+ * @param enable Nonzero to commit atomically
+ * @return 0 on success; <0 on error
+ */
+int vdisk_cache_atomic(int enable)
+{
+	VDISK_LOCK();
+
+	// Nothing may reach the file before the copy is made
+	if(enable && vdisk_cache_write_back(VDISK_WRITE_BACK_ALL) < 0)
+		return(-1);
+	atomic = enable;
+	return(0);
+}
+
+/**
+ * Give up the commit lock, if it is held
+ */
+static void vdisk_unlock()
+{
+	if(lock_fd >= 0)
+		close(lock_fd);
+	lock_fd = -1;
+}
+
+/**
+ * Switch vdisk_fd to a fresh copy of the disk file, the first time it is
+ * about to be written in atomic mode
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_shadow()
+{
+	if(!atomic || shadowed)
+		return(0);
+	if(commit_failed)
+		return(-1);
+	commit_failed = 1;
+
+	// One writer at a time, and only on the current version
+	char lock_name[PATH_MAX + 8];
+	snprintf(lock_name, sizeof(lock_name), "%s.lock", disk_name);
+	lock_fd = open(lock_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0) {
+		fprintf(stderr, "vdisk_shadow(): unable to lock %s\n", lock_name);
+		vdisk_unlock();
+		return(-1);
+	}
+	struct stat opened, current;
+	if(fstat(vdisk_fd, &opened) < 0 || stat(disk_name, &current) < 0
+			|| opened.st_ino != current.st_ino || opened.st_dev != current.st_dev) {
+		fprintf(stderr, "vdisk_shadow(): %s was changed by another process\n", disk_name);
+		vdisk_unlock();
+		return(-1);
+	}
+
+	char shadow_name[PATH_MAX + 4];
+	snprintf(shadow_name, sizeof(shadow_name), "%s.new", disk_name);
+	int fd = open(shadow_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd < 0) {
+		fprintf(stderr, "vdisk_shadow(): unable to create %s\n", shadow_name);
+		vdisk_unlock();
+		return(-1);
+	}
+
+	// The copy replaces the disk, so it gets the disk's mode and, where
+	//  this process may set it, its owner
+	if(fchmod(fd, opened.st_mode & 07777) < 0) {
+		fprintf(stderr, "vdisk_shadow(): unable to set the mode of %s\n", shadow_name);
+		close(fd);
+		unlink(shadow_name);
+		vdisk_unlock();
+		return(-1);
+	}
+	fchown(fd, opened.st_uid, opened.st_gid);
+
+	// Whole file: the kernel may share the extents instead of copying them
+	loff_t in = 0, out = 0;
+	ssize_t copied = 0;
+	while(in < opened.st_size && (copied = copy_file_range(vdisk_fd, &in, fd, &out, opened.st_size - in, 0)) > 0)
+		;
+	if(copied < 0) {
+		// No kernel support for this pair: copy through a buffer
+		char buf[BLOCK_SIZE * 16];
+		while(in < opened.st_size && (copied = pread(vdisk_fd, buf, sizeof(buf), in)) > 0
+				&& pwrite(fd, buf, copied, in) == copied)
+			in += copied;
+	}
+	if(in < opened.st_size || copied < 0) {
+		fprintf(stderr, "vdisk_shadow(): unable to copy %s\n", disk_name);
+		close(fd);
+		unlink(shadow_name);
+		vdisk_unlock();
+		return(-1);
+	}
+
+	close(vdisk_fd);
+	vdisk_fd = fd;
+	shadowed = 1;
+	commit_failed = 0;
+	return(0);
+}
+
+/**
+ * Write all changed blocks to the file, in block order, with one request
+ * for each run of consecutive blocks.  Runs separated by no more than
+ * VDISK_FLUSH_GAP cached blocks are written as one, gap included
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_cache_flush()
+{
+	VDISK_LOCK();
+
+	struct iovec iov[N_BLOCKS_IN_DISK];
+	int n = 0;
+	BLOCK_REFERENCE first = 0;
+
+	for(int i = 0; i <= N_BLOCKS_IN_DISK; ++i) {
+		VDISK_CACHE_ENTRY *entry = NULL;
+		if(i < N_BLOCKS_IN_DISK && cache_slot[i] != 0 && cache[cache_slot[i] - 1].dirty)
+			entry = &cache[cache_slot[i] - 1];
+
+		// A clean block in a short, fully cached gap before the next changed one
+		if(entry == NULL && n > 0 && i < N_BLOCKS_IN_DISK && cache_slot[i] != 0) {
+			for(int j = i + 1; j < N_BLOCKS_IN_DISK && j <= i + VDISK_FLUSH_GAP && cache_slot[j] != 0; ++j) {
+				if(cache[cache_slot[j] - 1].dirty) {
+					entry = &cache[cache_slot[i] - 1];
+					break;
+				}
+			}
+		}
+
+		// End of a run?
+		if(entry == NULL && n > 0) {
+			if(debug)
+				fprintf(stderr, "##Flushing blocks %d-%d\n", first, first + n - 1);
+			if(vdisk_shadow() < 0)
+				return(-4);
+			if(pwritev(vdisk_fd, iov, n, (off_t) first * BLOCK_SIZE) != (ssize_t) n * BLOCK_SIZE) {
+				fprintf(stderr, "vdisk_cache_flush(): write failed\n");
+				return(-4);
+			}
+			for(int j = first; j < first + n; ++j)
+				cache[cache_slot[j] - 1].dirty = 0;
+			n = 0;
+		}
+
+		if(entry != NULL) {
+			if(n == 0)
+				first = i;
+			iov[n].iov_base = entry->data;
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		}
+	}
+
+	return(0);
+}
+
+/**
+ * Write out changed blocks if any of them fall in a run of blocks, before
+ * the run is read from the file behind the cache's back
+ *
+ * @param first Index of the first block
+ * @param n_blocks Number of blocks
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_cache_flush_range(BLOCK_REFERENCE first, int n_blocks)
+{
+	for(int i = first; i < first + n_blocks && i < N_BLOCKS_IN_DISK; ++i)
+		if(cache_slot[i] != 0 && cache[cache_slot[i] - 1].dirty)
+			return(vdisk_cache_flush());
+	return(0);
+}
+
+/**
+ * Remove a block from its cache slot, writing it out first if it has
+ * changed.  The slot is freed even when the write fails; the change is
+ * then lost, and the disk is marked so that close reports it
+ *
+ * @param entry Slot holding the block
+ * @return 0 on success; <0 if a change was lost
+ */
+static int vdisk_cache_evict(VDISK_CACHE_ENTRY *entry)
+{
+	int ret = 0;
+
+	// Write the whole batch rather than this one block.  If that fails, the
+	//  change must not go to the disk file on its own either
+	if(entry->dirty && write_back == VDISK_WRITE_BACK_ALL && vdisk_cache_flush() < 0) {
+		fprintf(stderr, "vdisk_cache_evict(): change to block %d lost\n", entry->block_ref);
+		entry->dirty = 0;
+		ret = -4;
+	}
+
+	if(entry->dirty) {
+		if(pwrite(vdisk_fd, entry->data, BLOCK_SIZE, (off_t) entry->block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
+			fprintf(stderr, "vdisk_cache_evict(): write of block %d failed\n", entry->block_ref);
+			ret = -4;
+		}
+		entry->dirty = 0;
+	}
+	if(ret < 0)
+		commit_failed = 1;
+	cache_slot[entry->block_ref] = 0;
+	queue_length[entry->queue]--;
+	entry->block_ref = -1;
+	return(ret);
+}
+
+/**
+ * Place a copy of a block in the cache.  If the block's class has no
+ * room left, a block is replaced: the least recently used metadata block
+ * for metadata; for data, the oldest block on probation, unless
+ * probation is below its share, in which case the least recently used
+ * protected block
+ *
+ * @param block_ref Index of the block
+ * @param block Contents of the block
+ * @return 0 on success; <0 if a change to the replaced block was lost
+ *         (the block is cached all the same)
+ */
+static int vdisk_cache_insert(BLOCK_REFERENCE block_ref, const void *block)
+{
+	VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(block_ref);
+	int ret = 0;
+
+	if(entry == NULL) {
+		int queue = CACHE_QUEUE_PROBATION;
+		int victim_queue = -1;
+		if(block_class[block_ref] == VDISK_CACHE_METADATA) {
+			queue = CACHE_QUEUE_METADATA;
+			if(queue_length[CACHE_QUEUE_METADATA] >= VDISK_CACHE_METADATA_BLOCKS)
+				victim_queue = CACHE_QUEUE_METADATA;
+		} else if(queue_length[CACHE_QUEUE_PROBATION] + queue_length[CACHE_QUEUE_PROTECTED] >= VDISK_CACHE_BLOCKS) {
+			if(queue_length[CACHE_QUEUE_PROBATION] >= VDISK_CACHE_PROBATION_BLOCKS
+					|| queue_length[CACHE_QUEUE_PROTECTED] == 0)
+				victim_queue = CACHE_QUEUE_PROBATION;
+			else
+				victim_queue = CACHE_QUEUE_PROTECTED;
+		}
+
+		// An empty slot always exists while the class is under its quota
+		for(int i = 0; i < N_CACHE_SLOTS; ++i) {
+			if(victim_queue < 0) {
+				if(cache[i].block_ref < 0) {
+					entry = &cache[i];
+					break;
+				}
+			} else if(cache[i].block_ref >= 0 && cache[i].queue == victim_queue
+					&& (entry == NULL || cache[i].last_use < entry->last_use))
+				entry = &cache[i];
+		}
+
+		if(entry->block_ref >= 0)
+			ret = vdisk_cache_evict(entry);
+		entry->block_ref = block_ref;
+		entry->queue = queue;
+		entry->dirty = 0;
+		entry->last_use = ++cache_clock;
+		queue_length[queue]++;
+		cache_slot[block_ref] = entry - cache + 1;
+	}
+
+	memcpy(entry->data, block, BLOCK_SIZE);
+	return(ret);
+}
+
+/**
+ * Remove a run of blocks from the cache
+ *
+ * @param first Index of the first block
+ * @param n_blocks Number of blocks
+ * @return 0 on success; <0 if a change to one of them was lost
+ */
+int vdisk_cache_drop(BLOCK_REFERENCE first, int n_blocks)
+{
+	VDISK_LOCK();
+
+	int ret = 0;
+	for(int i = first; i < first + n_blocks && i < N_BLOCKS_IN_DISK; ++i) {
+		if(cache_slot[i] != 0 && vdisk_cache_evict(&cache[cache_slot[i] - 1]) < 0)
+			ret = -4;
+	}
+	return(ret);
+}
+
+/**
+ * Warm the cache from a hot-block list saved by an earlier process, and
+ * save a new list to the same file when the disk is closed.  The list
+ * holds the VDISK_HOT_BLOCKS most read blocks, as BLOCK_REFERENCEs.  The
+ * blocks are read with one request covering all of them; only the
+ * listed blocks are kept
+ *
+ * @param list_name File holding the list.  A missing file is not an error
+ * @return 0 on success; <0 on error
+ */
+int vdisk_cache_warm(char *list_name)
+{
+	VDISK_LOCK();
+
+	strncpy(hot_list_name, list_name, PATH_MAX - 1);
+	hot_list_name[PATH_MAX - 1] = 0;
+
+	int fd = open(list_name, O_RDONLY);
+	if(fd < 0)
+		return(0);
+	BLOCK_REFERENCE hot[VDISK_HOT_BLOCKS];
+	ssize_t n = read(fd, hot, sizeof(hot));
+	close(fd);
+	if(n <= 0)
+		return(0);
+	n /= sizeof(BLOCK_REFERENCE);
+
+	// Span of the listed blocks
+	int first = N_BLOCKS_IN_DISK, last = -1;
+	for(int i = 0; i < n; ++i) {
+		if(hot[i] >= N_BLOCKS_IN_DISK)
+			continue;
+		if(hot[i] < first)
+			first = hot[i];
+		if(hot[i] > last)
+			last = hot[i];
+	}
+	if(last < 0)
+		return(0);
+
+	static unsigned char blocks[N_BLOCKS_IN_DISK][BLOCK_SIZE];
+	ssize_t len = (ssize_t) (last - first + 1) * BLOCK_SIZE;
+	if(pread(vdisk_fd, blocks, len, (off_t) first * BLOCK_SIZE) != len) {
+		// The disk may be shorter than the list says (e.g. not formatted)
+		return(0);
+	}
+
+	for(int i = 0; i < n; ++i) {
+		if(hot[i] < N_BLOCKS_IN_DISK && cache_slot[hot[i]] == 0
+				&& vdisk_cache_insert(hot[i], blocks[hot[i] - first]) < 0)
+			return(-4);
+
+		// Carry the block over, behind the ones this process uses
+		if(hot[i] < N_BLOCKS_IN_DISK && access_count[hot[i]] == 0)
+			access_count[hot[i]] = 1;
+	}
+	return(0);
+}
+
+/**
+ * Flush the directory holding the disk file, so that a rename of the file
+ * survives a crash
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_sync_directory()
+{
+	char dir_name[PATH_MAX];
+	strcpy(dir_name, disk_name);
+	char *slash = strrchr(dir_name, '/');
+	if(slash == NULL)
+		strcpy(dir_name, ".");
+	else
+		slash[slash == dir_name] = 0;
+
+	int fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+	if(fd < 0)
+		return(-1);
+	int ret = fsync(fd);
+	close(fd);
+	return(ret);
+}
+
+/**
+ * Save the hot-block list named by vdisk_cache_warm(), most read first.
+ * Only a writer that holds the commit lock and has committed saves it,
+ * so readers and refused writers never write, and the list is written
+ * to <list>.tmp and renamed into place so no process ever warms from half
+ * a list.  The list is only a hint: a failure is reported but is not an
+ * error
+ */
+static void vdisk_cache_save_hot()
+{
+	if(hot_list_name[0] == 0 || lock_fd < 0)
+		return;
+
+	BLOCK_REFERENCE hot[VDISK_HOT_BLOCKS];
+	int n = 0;
+	unsigned char taken[N_BLOCKS_IN_DISK] = {0};
+	while(n < VDISK_HOT_BLOCKS) {
+		int best = -1;
+		for(int i = 0; i < N_BLOCKS_IN_DISK; ++i)
+			if(!taken[i] && access_count[i] > 0 && (best < 0 || access_count[i] > access_count[best]))
+				best = i;
+		if(best < 0)
+			break;
+		taken[best] = 1;
+		hot[n++] = best;
+	}
+
+	char tmp_name[PATH_MAX + 4];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", hot_list_name);
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	ssize_t len = n * sizeof(BLOCK_REFERENCE);
+	int ok = fd >= 0 && write(fd, hot, len) == len;
+	if(fd >= 0)
+		close(fd);
+	if(!ok || rename(tmp_name, hot_list_name) < 0) {
+		fprintf(stderr, "vdisk_disk_close(): warning: unable to save hot blocks (%s)\n", hot_list_name);
+		unlink(tmp_name);
+	}
+}
+
 /**
  * Open the virtual disk
  *
@@ -23,6 +637,8 @@ int vdisk_fd = 0;
  */
 int vdisk_disk_open(char *virtual_disk_name)
 {
+	VDISK_LOCK();
+
 	if(vdisk_fd != 0) {
 		fprintf(stderr, "A disk is already opened\n");
 		return(-1);
@@ -40,6 +656,12 @@ int vdisk_disk_open(char *virtual_disk_name)
 
 	// Remember the fd in the global variable
 	vdisk_fd = fd;
+	strncpy(disk_name, virtual_disk_name, PATH_MAX - 1);
+	disk_name[PATH_MAX - 1] = 0;
+	atomic = 0;
+	shadowed = 0;
+	commit_failed = 0;
+	vdisk_cache_reset();
 	return(0);
 };
 
@@ -50,18 +672,45 @@ int vdisk_disk_open(char *virtual_disk_name)
  */
 int vdisk_disk_close()
 {
+	VDISK_LOCK();
+
 	// Must be initialized to clos it
 	if(vdisk_fd == 0) {
 		fprintf(stderr, "vdisk_disk_close(): disk not initialized\n");
 		exit(-1);
 	};
 
-	// Close the file
+	// Write out anything held back, then close the file
+	int ret = vdisk_cache_flush();
+	if(ret == 0 && commit_failed) {
+		fprintf(stderr, "vdisk_disk_close(): changes to %s were lost\n", disk_name);
+		ret = -1;
+	}
+
+	// Commit: the copy takes the place of the disk in one step, which
+	//  only lasts once the directory holding it is on disk too
+	if(shadowed) {
+		char shadow_name[PATH_MAX + 4];
+		snprintf(shadow_name, sizeof(shadow_name), "%s.new", disk_name);
+		if(ret == 0 && (fsync(vdisk_fd) < 0 || rename(shadow_name, disk_name) < 0)) {
+			fprintf(stderr, "vdisk_disk_close(): unable to commit %s\n", disk_name);
+			ret = -1;
+		}
+		if(ret < 0)
+			unlink(shadow_name);
+		else if(vdisk_sync_directory() < 0) {
+			fprintf(stderr, "vdisk_disk_close(): unable to sync the directory of %s\n", disk_name);
+			ret = -1;
+		}
+	}
+	if(ret == 0)
+		vdisk_cache_save_hot();
+	vdisk_unlock();
 	close(vdisk_fd);
 
 	// Mark as closed
 	vdisk_fd = 0;
-	return(0);
+	return(ret);
 }
 
 /**
@@ -74,6 +723,8 @@ int vdisk_disk_close()
  */
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
 {
+	VDISK_LOCK();
+
 	if(debug)
 		fprintf(stderr, "##Reading block %d\n", block_ref);
 
@@ -89,15 +740,23 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
 		return(-2);
 	}
 
-	// Lsek to the correct point in the file
-	if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-		fprintf(stderr, "vdisk_read_block(): seek failed\n");
-		return(-3);
+	access_count[block_ref]++;
+
+	// Cached?
+	VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(block_ref);
+	if(entry != NULL) {
+		memcpy(block, entry->data, BLOCK_SIZE);
+		return(0);
 	}
-	if(read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+
+	// Read at the correct point in the file (positional, so the file
+	//  offset is never shared between callers)
+	if(pread(vdisk_fd, block, BLOCK_SIZE, (off_t) block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
 		fprintf(stderr, "vdisk_read_block(): read failed\n");
 		return(-4);
 	}
+	if(vdisk_cache_insert(block_ref, block) < 0)
+		return(-4);
 
 	// Success
 	return(0);
@@ -112,6 +771,8 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
  */
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
 {
+	VDISK_LOCK();
+
 	if(debug)
 		fprintf(stderr, "##Writing block %d\n", block_ref);
 
@@ -127,18 +788,442 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
 		return(-2);
 	}
 
-	// Move to the beginning of the block
-	if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-		fprintf(stderr, "vdisk_write_block(): seek failed\n");
-		return(-3);
+	// Held in the cache until close?
+	if(write_back == VDISK_WRITE_BACK_ALL
+			|| (write_back == VDISK_WRITE_BACK_METADATA && block_class[block_ref] == VDISK_CACHE_METADATA)) {
+		int ret = vdisk_cache_insert(block_ref, block);
+		cache[cache_slot[block_ref] - 1].dirty = 1;
+		return(ret);
 	}
 
-	// Read the block
-	if(write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+	// Write the block at its position in the file
+	if(pwrite(vdisk_fd, block, BLOCK_SIZE, (off_t) block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
 		fprintf(stderr, "vdisk_write_block(): read failed\n");
 		return(-4);
 	}
+	if(vdisk_cache_insert(block_ref, block) < 0)
+		return(-4);
+
+	// Success
+	return(0);
+}
+
+/**
+ *  Check a vectored request: the buffers must cover whole blocks that
+ *  are all on the disk
+ *
+ * @param name Name of the caller, for error messages
+ * @param first Index of the first block
+ * @param iov Buffers
+ * @param iovcnt Number of buffers
+ * @return Number of bytes covered by the buffers; <0 on error
+ */
+static ssize_t vdisk_check_vector(char *name, BLOCK_REFERENCE first, const struct iovec *iov, int iovcnt)
+{
+	// File open?
+	if(vdisk_fd == 0) {
+		fprintf(stderr, "%s(): disk not initialized\n", name);
+		exit(-1);
+	};
+
+	ssize_t total = 0;
+	for(int i = 0; i < iovcnt; ++i)
+		total += iov[i].iov_len;
+
+	if(total % BLOCK_SIZE != 0 || first + total / BLOCK_SIZE > N_BLOCKS_IN_DISK) {
+		fprintf(stderr, "%s(): bad block range (%d, %ld bytes)\n", name, first, (long) total);
+		return(-2);
+	}
+
+	return(total);
+}
+
+/**
+ *  Copy whole blocks between the cache and a list of buffers
+ *
+ * @param first Index of the block the buffers start at
+ * @param iov Buffers, covering a whole number of blocks
+ * @param iovcnt Number of buffers
+ * @param to_cache Nonzero to place the blocks in the cache (updating any
+ *        copy already there), and 2 to also mark them changed (held back
+ *        by write-back); zero to fill the buffers from the cache
+ * @param only_cached Only touch blocks that are already cached
+ * @return 0 on success; <0 if a change to a replaced block was lost
+ */
+static int vdisk_cache_copy(BLOCK_REFERENCE first, const struct iovec *iov, int iovcnt, int to_cache, int only_cached)
+{
+	unsigned char block[BLOCK_SIZE];
+	int filled = 0;
+	BLOCK_REFERENCE block_ref = first;
+	int ret = 0;
+
+	for(int i = 0; i < iovcnt; ++i) {
+		for(size_t done = 0; done < iov[i].iov_len; ) {
+			size_t n = iov[i].iov_len - done;
+			if(n > (size_t) (BLOCK_SIZE - filled))
+				n = BLOCK_SIZE - filled;
+
+			if(to_cache)
+				memcpy(block + filled, (char *) iov[i].iov_base + done, n);
+			else
+				memcpy((char *) iov[i].iov_base + done, vdisk_cache_lookup(block_ref)->data + filled, n);
+			done += n;
+			filled += n;
+
+			// Block complete
+			if(filled == BLOCK_SIZE) {
+				if(to_cache && (!only_cached || cache_slot[block_ref] != 0)) {
+					if(vdisk_cache_insert(block_ref, block) < 0)
+						ret = -4;
+					if(to_cache == 2)
+						cache[cache_slot[block_ref] - 1].dirty = 1;
+				}
+				filled = 0;
+				block_ref++;
+			}
+		}
+	}
+	return(ret);
+}
+
+/**
+ *  Copy a cached block over its place in a list of buffers
+ *
+ * @param first Index of the block the buffers start at
+ * @param iov Buffers, covering a whole number of blocks
+ * @param iovcnt Number of buffers
+ * @param block_ref Index of the cached block
+ */
+static void vdisk_cache_patch(BLOCK_REFERENCE first, const struct iovec *iov, int iovcnt, BLOCK_REFERENCE block_ref)
+{
+	const unsigned char *data = cache[cache_slot[block_ref] - 1].data;
+	size_t start = (size_t) (block_ref - first) * BLOCK_SIZE;
+	size_t pos = 0;
+	int copied = 0;
+
+	for(int i = 0; i < iovcnt && copied < BLOCK_SIZE; ++i) {
+		if(pos + iov[i].iov_len > start + copied) {
+			size_t skip = start + copied - pos;
+			size_t n = iov[i].iov_len - skip;
+			if(n > (size_t) (BLOCK_SIZE - copied))
+				n = BLOCK_SIZE - copied;
+			memcpy((char *) iov[i].iov_base + skip, data + copied, n);
+			copied += n;
+		}
+		pos += iov[i].iov_len;
+	}
+}
+
+/**
+ *  Read a run of consecutive blocks with one request.  The buffers are
+ *  filled in order; together they must cover a whole number of blocks.
+ *  If every block is cached, no request is made at all
+ *
+ * @param first Index of the first block to read
+ * @param iov Buffers that the blocks will be placed into
+ * @param iovcnt Number of buffers
+ * @param flags VDISK_NOCACHE to leave blocks that are read out of the cache
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_readv_blocks(BLOCK_REFERENCE first, const struct iovec *iov, int iovcnt, int flags)
+{
+	VDISK_LOCK();
+
+	ssize_t total = vdisk_check_vector("vdisk_readv_blocks", first, iov, iovcnt);
+	if(total < 0)
+		return(total);
+
+	// Served entirely from the cache?
+	int cached = 1;
+	for(int i = first; i < first + total / BLOCK_SIZE; ++i) {
+		access_count[i]++;
+		if(cache_slot[i] == 0)
+			cached = 0;
+	}
+	if(cached) {
+		vdisk_cache_copy(first, iov, iovcnt, 0, 0);
+		return(0);
+	}
+
+	if(debug)
+		fprintf(stderr, "##Reading blocks %d-%d\n", first, first + (int) (total / BLOCK_SIZE) - 1);
+
+	if(preadv(vdisk_fd, iov, iovcnt, (off_t) first * BLOCK_SIZE) != total) {
+		fprintf(stderr, "vdisk_readv_blocks(): read failed\n");
+		return(-4);
+	}
+
+	// Blocks held back by write-back are newer than the file
+	for(int i = first; i < first + total / BLOCK_SIZE; ++i)
+		if(cache_slot[i] != 0 && cache[cache_slot[i] - 1].dirty)
+			vdisk_cache_patch(first, iov, iovcnt, i);
+
+	if(!(flags & VDISK_NOCACHE) && vdisk_cache_copy(first, iov, iovcnt, 1, 0) < 0)
+		return(-4);
 
 	// Success
 	return(0);
 }
+
+/**
+ *  Read a run of consecutive blocks into the cache with one request,
+ *  ahead of their use
+ *
+ * @param first Index of the first block
+ * @param n_blocks Number of blocks
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_cache_prefetch(BLOCK_REFERENCE first, int n_blocks)
+{
+	VDISK_LOCK();
+
+	unsigned char blocks[VDISK_CACHE_BLOCKS][BLOCK_SIZE];
+
+	// More than the cache holds would only evict the start of the run
+	if(n_blocks > VDISK_CACHE_BLOCKS)
+		n_blocks = VDISK_CACHE_BLOCKS;
+
+	struct iovec iov = { blocks, (size_t) n_blocks * BLOCK_SIZE };
+	return(vdisk_readv_blocks(first, &iov, 1, 0));
+}
+
+/**
+ *  Write a run of consecutive blocks with one request.  The buffers are
+ *  written in order; together they must cover a whole number of blocks
+ *
+ * @param first Index of the first block to write
+ * @param iov Buffers holding the blocks
+ * @param iovcnt Number of buffers
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_writev_blocks(BLOCK_REFERENCE first, const struct iovec *iov, int iovcnt)
+{
+	VDISK_LOCK();
+
+	ssize_t total = vdisk_check_vector("vdisk_writev_blocks", first, iov, iovcnt);
+	if(total < 0)
+		return(total);
+
+	if(debug)
+		fprintf(stderr, "##Writing blocks %d-%d\n", first, first + (int) (total / BLOCK_SIZE) - 1);
+
+	// Held in the cache, to be written with the other changed blocks
+	if(write_back == VDISK_WRITE_BACK_ALL) {
+		return(vdisk_cache_copy(first, iov, iovcnt, 2, 0));
+	}
+
+	if(vdisk_shadow() < 0)
+		return(-4);
+	if(pwritev(vdisk_fd, iov, iovcnt, (off_t) first * BLOCK_SIZE) != total) {
+		fprintf(stderr, "vdisk_writev_blocks(): write failed\n");
+		return(-4);
+	}
+
+	// Keep cached copies current; the file now holds them.  Only blocks
+	//  already cached are touched, so nothing is evicted
+	vdisk_cache_copy(first, iov, iovcnt, 1, 1);
+	for(int i = first; i < first + total / BLOCK_SIZE; ++i)
+		if(cache_slot[i] != 0)
+			cache[cache_slot[i] - 1].dirty = 0;
+
+	// Success
+	return(0);
+}
+
+/**
+ *  Copy bytes from a run of consecutive blocks straight to another file
+ *  descriptor, without passing them through a user buffer.  Falls back
+ *  to reading and writing if the kernel cannot send between the two
+ *
+ * @param out_fd Descriptor to write the bytes to
+ * @param first Index of the block the bytes start in
+ * @param offset Byte offset of the first byte within that block
+ * @param len Number of bytes to copy
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_sendfile(int out_fd, BLOCK_REFERENCE first, int offset, int len)
+{
+	VDISK_LOCK();
+
+	// File open?
+	if(vdisk_fd == 0) {
+		fprintf(stderr, "vdisk_sendfile(): disk not initialized\n");
+		exit(-1);
+	};
+
+	off_t position = (off_t) first * BLOCK_SIZE + offset;
+	if(len < 0 || position + len > (off_t) N_BLOCKS_IN_DISK * BLOCK_SIZE) {
+		fprintf(stderr, "vdisk_sendfile(): bad range (%d, %d, %d)\n", first, offset, len);
+		return(-2);
+	}
+
+	if(debug)
+		fprintf(stderr, "##Sending %d bytes from block %d\n", len, first);
+
+	// The file must hold any changes still in the cache
+	if(vdisk_cache_flush_range(first, (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE) < 0)
+		return(-4);
+
+	while(len > 0) {
+		ssize_t sent = sendfile(out_fd, vdisk_fd, &position, len);
+
+		if(sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			// No kernel support for this pair: copy through a buffer
+			char buf[BLOCK_SIZE];
+			sent = pread(vdisk_fd, buf, len < BLOCK_SIZE ? len : BLOCK_SIZE, position);
+			if(sent > 0) {
+				sent = write(out_fd, buf, sent);
+				if(sent > 0)
+					position += sent;
+			}
+		}
+
+		if(sent <= 0) {
+			fprintf(stderr, "vdisk_sendfile(): send failed\n");
+			return(-4);
+		}
+		len -= sent;
+	}
+
+	// Success
+	return(0);
+}
+
+/**
+ *  Copy bytes from the current position of another file descriptor into
+ *  a run of consecutive blocks, without passing them through a user
+ *  buffer.  Falls back to reading and writing if the kernel cannot copy
+ *  between the two
+ *
+ * @param in_fd Descriptor to read the bytes from
+ * @param first Index of the first block to fill
+ * @param len Number of bytes to copy
+ * @return 0 on success; <0 on error (including in_fd ending early)
+ *
+ */
+int vdisk_import(int in_fd, BLOCK_REFERENCE first, int len)
+{
+	VDISK_LOCK();
+
+	// File open?
+	if(vdisk_fd == 0) {
+		fprintf(stderr, "vdisk_import(): disk not initialized\n");
+		exit(-1);
+	};
+
+	loff_t position = (loff_t) first * BLOCK_SIZE;
+	if(len < 0 || position + len > (loff_t) N_BLOCKS_IN_DISK * BLOCK_SIZE) {
+		fprintf(stderr, "vdisk_import(): bad range (%d, %d)\n", first, len);
+		return(-2);
+	}
+
+	if(debug)
+		fprintf(stderr, "##Importing %d bytes into block %d\n", len, first);
+
+	// With batched writes (write-back of all blocks without atomic
+	//  commits) the file may only see sorted batches, so the bytes are
+	//  read into the cache, to be written with the other changed blocks.
+	//  A partial last block keeps the rest of its old contents
+	if(write_back == VDISK_WRITE_BACK_ALL && !atomic) {
+		for(BLOCK_REFERENCE block_ref = first; len > 0; ++block_ref) {
+			unsigned char block[BLOCK_SIZE];
+			int n = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+			if(n < BLOCK_SIZE && vdisk_read_block(block_ref, block) < 0)
+				return(-4);
+			for(int done = 0; done < n; ) {
+				ssize_t got = read(in_fd, block + done, n - done);
+				if(got <= 0) {
+					fprintf(stderr, "vdisk_import(): copy failed\n");
+					return(-4);
+				}
+				done += got;
+			}
+			if(vdisk_write_block(block_ref, block) < 0)
+				return(-4);
+			len -= n;
+		}
+		return(0);
+	}
+
+	// The copy bypasses the cache.  In atomic mode it goes into the copy
+	//  of the disk that is committed at close, which no other process
+	//  sees, so the kernel copy applies there too.  Changed blocks in the
+	//  range are written out before they are dropped, so a partial last
+	//  block keeps the rest of its contents
+	if(vdisk_shadow() < 0 || vdisk_cache_drop(first, (len + BLOCK_SIZE - 1) / BLOCK_SIZE) < 0)
+		return(-4);
+
+	while(len > 0) {
+		ssize_t copied = copy_file_range(in_fd, NULL, vdisk_fd, &position, len, 0);
+
+		if(copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+			// No kernel support for this pair: copy through a buffer
+			char buf[BLOCK_SIZE * 16];
+			copied = read(in_fd, buf, len < (int) sizeof(buf) ? len : (int) sizeof(buf));
+			if(copied > 0 && pwrite(vdisk_fd, buf, copied, position) != copied)
+				copied = -1;
+			if(copied > 0)
+				position += copied;
+		}
+
+		if(copied <= 0) {
+			fprintf(stderr, "vdisk_import(): copy failed\n");
+			return(-4);
+		}
+		len -= copied;
+	}
+
+	// Success
+	return(0);
+}
+
+/**
+ *  Map a run of consecutive blocks read-only into memory.  The mapping
+ *  covers the whole pages around the blocks and shares the disk's pages,
+ *  so it sees later writes to the blocks
+ *
+ * @param first Index of the first block
+ * @param n_blocks Number of blocks
+ * @param base Filled in with the start of the mapping (for munmap)
+ * @param base_len Filled in with the length of the mapping (for munmap)
+ * @return Pointer to the first byte of block first; NULL on error
+ *
+ */
+void *vdisk_map(BLOCK_REFERENCE first, int n_blocks, void **base, size_t *base_len)
+{
+	VDISK_LOCK();
+
+	// File open?
+	if(vdisk_fd == 0) {
+		fprintf(stderr, "vdisk_map(): disk not initialized\n");
+		exit(-1);
+	};
+
+	if(n_blocks <= 0 || first + n_blocks > N_BLOCKS_IN_DISK) {
+		fprintf(stderr, "vdisk_map(): bad block range (%d, %d)\n", first, n_blocks);
+		return(NULL);
+	}
+
+	// The file must hold any changes still in the cache
+	if(vdisk_cache_flush_range(first, n_blocks) < 0)
+		return(NULL);
+
+	// Blocks are smaller than pages: map from the page holding the first one
+	off_t start = (off_t) first * BLOCK_SIZE;
+	off_t page_start = start - start % sysconf(_SC_PAGESIZE);
+	*base_len = start - page_start + (size_t) n_blocks * BLOCK_SIZE;
+	*base = mmap(NULL, *base_len, PROT_READ, MAP_SHARED, vdisk_fd, page_start);
+	if(*base == MAP_FAILED) {
+		fprintf(stderr, "vdisk_map(): mmap failed\n");
+		return(NULL);
+	}
+
+	if(debug)
+		fprintf(stderr, "##Mapping blocks %d-%d\n", first, first + n_blocks - 1);
+
+	return((char *) *base + (start - page_start));
+}
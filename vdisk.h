@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 typedef unsigned short BLOCK_REFERENCE;
 
@@ -15,10 +16,49 @@ typedef unsigned short BLOCK_REFERENCE;
 // Total number of blocks on the virtual disk
 #define N_BLOCKS_IN_DISK 128
 
+// Number of data blocks held in the block cache
+#define VDISK_CACHE_BLOCKS 32
+
+// Number of metadata blocks held in the block cache, apart from data
+// blocks: enough for all of the metadata on a full disk
+#define VDISK_CACHE_METADATA_BLOCKS 72
+
+// Number of blocks kept in the hot-block list (vdisk_cache_warm())
+#define VDISK_HOT_BLOCKS 16
+
+// Block classes for vdisk_cache_set_class()
+#define VDISK_CACHE_DATA 0
+#define VDISK_CACHE_METADATA 1
+
+// Modes for vdisk_cache_write_back(): hold writes to metadata blocks, or
+// to every block, in the cache
+#define VDISK_WRITE_THROUGH 0
+#define VDISK_WRITE_BACK_METADATA 1
+#define VDISK_WRITE_BACK_ALL 2
+
+// Longest run of clean cached blocks that vdisk_cache_flush() writes as
+// well, to join two runs of changed blocks into one request
+#define VDISK_FLUSH_GAP 4
+
+// vdisk_readv_blocks() flag: do not keep the blocks read in the cache
+#define VDISK_NOCACHE 0x01
+
 int vdisk_disk_open(char *virtual_disk_name);
 int vdisk_disk_close();
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_readv_blocks(BLOCK_REFERENCE first, const struct iovec *iov, int iovcnt, int flags);
+int vdisk_writev_blocks(BLOCK_REFERENCE first, const struct iovec *iov, int iovcnt);
+int vdisk_sendfile(int out_fd, BLOCK_REFERENCE first, int offset, int len);
+int vdisk_import(int in_fd, BLOCK_REFERENCE first, int len);
+void *vdisk_map(BLOCK_REFERENCE first, int n_blocks, void **base, size_t *base_len);
+int vdisk_cache_prefetch(BLOCK_REFERENCE first, int n_blocks);
+int vdisk_cache_drop(BLOCK_REFERENCE first, int n_blocks);
+void vdisk_cache_set_class(BLOCK_REFERENCE first, int n_blocks, int cache_class);
+int vdisk_cache_write_back(int mode);
+int vdisk_cache_flush();
+int vdisk_cache_atomic(int enable);
+int vdisk_cache_warm(char *list_name);
 
 #endif
 
@@ -0,0 +1,81 @@
+/**
+  Time path resolution in the OU File System, at each depth of a path.
+
+  For every prefix of the path (1 component, 2 components, ...), the
+  prefix is resolved repeatedly and the average time per resolution is
+  reported.  Blocks are cached after the first resolution, so this
+  measures the resolver itself rather than the disk.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+// Default number of resolutions at each depth
+#define DEFAULT_ITERATIONS 100000
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Check arguments
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: zbench <path> [<iterations>]\n");
+		return -1;
+	}
+	int iterations = argc == 3 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+	if (iterations <= 0 || strlen(argv[1]) >= MAX_PATH_LENGTH) {
+		fprintf(stderr, "Usage: zbench <path> [<iterations>]\n");
+		return -1;
+	}
+
+	// Open the virtual disk
+	if (oufs_disk_open(disk_name) != 0) return -1;
+
+	printf("depth\tns/resolve\tpath\n");
+
+	char prefix[MAX_PATH_LENGTH];
+	int depth = 0;
+	for (char * p = argv[1]; *p; ) {
+
+		// End of the next component
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+		while (*p && *p != '/')
+			p++;
+		depth++;
+
+		memcpy(prefix, argv[1], p - argv[1]);
+		prefix[p - argv[1]] = 0;
+
+		INODE_REFERENCE parent, child;
+		if (oufs_find_file(cwd, prefix, &parent, &child) != 1) {
+			fprintf(stderr, "%s not found\n", prefix);
+			break;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < iterations; i++)
+			oufs_find_file(cwd, prefix, &parent, &child);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+		printf("%d\t%.1f\t\t%s\n", depth, ns / iterations, prefix);
+	}
+
+	// Clean up
+	oufs_disk_close();
+	return 0;
+}
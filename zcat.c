@@ -0,0 +1,45 @@
+/**
+  Print files from the OU File System.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Check arguments
+	if (argc >= 2) {
+
+		// Open the virtual disk
+		oufs_disk_open(disk_name);
+
+		// Send each file straight to stdout
+		int ret = 0;
+		fflush(stdout);
+		for (int i = 1; i < argc; i++) {
+			OUFILE * fp = oufs_fopen(cwd, argv[i], "r");
+			if (!fp || oufs_sendfile(fp, STDOUT_FILENO, 0, -1) < 0) ret = -1;
+			if (fp) oufs_fclose(fp);
+		}
+
+		// Clean up
+		oufs_disk_close();
+		return ret;
+
+	} else {
+		// Wrong number of parameters
+		fprintf(stderr, "Usage: zcat <filename> ...\n");
+		return -1;
+	}
+
+}
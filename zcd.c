@@ -0,0 +1,133 @@
+/**
+  Change the current working directory of the OU File System.
+
+  A program cannot change its shell's environment, so zcd prints the
+  new values of ZPWD and ZPWD_INODE as shell commands:
+
+      zcd() { eval "$(command zcd "$@")"; }
+
+  ZPWD_INODE lets later commands start path walks at the cwd instead of
+  at the root.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/**
+ * Join cwd and path into an absolute path, handling . and .. lexically
+ *
+ * @param cwd Current working directory
+ * @param path Path, absolute or relative to cwd
+ * @param result Buffer of MAX_PATH_LENGTH bytes for the result
+ *
+ * @return 0 on success; < 0 if the result is too long
+ */
+int normalize(char * cwd, char * path, char * result) {
+	int len = 0;
+	char * parts[2] = {path[0] == '/' ? "" : cwd, path};
+
+	result[0] = 0;
+	for (int w = 0; w < 2; w++) {
+		for (char * p = parts[w]; *p; ) {
+			while (*p == '/')
+				p++;
+			char * start = p;
+			while (*p && *p != '/')
+				p++;
+			int n = p - start;
+
+			if (n == 0 || (n == 1 && start[0] == '.'))
+				continue;
+			if (n == 2 && start[0] == '.' && start[1] == '.') {
+				// Drop the last component
+				while (len > 0 && result[len - 1] != '/')
+					len--;
+				if (len > 0)
+					len--;
+				result[len] = 0;
+				continue;
+			}
+
+			if (len + 1 + n >= MAX_PATH_LENGTH)
+				return -1;
+			result[len++] = '/';
+			memcpy(result + len, start, n);
+			len += n;
+			result[len] = 0;
+		}
+	}
+
+	if (len == 0)
+		strcpy(result, "/");
+	return 0;
+}
+
+/**
+ * Print a string in single quotes for the shell, so that eval takes it as
+ * one word whatever it holds.  Each ' in it becomes '\''
+ *
+ * @param str String to print
+ */
+void print_quoted(char * str) {
+	putchar('\'');
+	for (char * p = str; *p; p++) {
+		if (*p == '\'')
+			fputs("'\\''", stdout);
+		else
+			putchar(*p);
+	}
+	putchar('\'');
+}
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Check arguments
+	if (argc > 2) {
+		fprintf(stderr, "Usage: zcd [<dirname>]\n");
+		return -1;
+	}
+
+	// With no directory, go to the root
+	char * path = argc == 2 ? argv[1] : "/";
+	char new_cwd[MAX_PATH_LENGTH];
+	if (normalize(cwd, path, new_cwd) < 0) {
+		fprintf(stderr, "Path too long\n");
+		return -1;
+	}
+
+	// Open the virtual disk
+	if (oufs_disk_open(disk_name) != 0) return -1;
+
+	// Resolve the path as given rather than new_cwd, so that a .. after
+	//  something that is not a directory is refused
+	INODE_REFERENCE parent, child;
+	INODE inode;
+	BLOCK master;
+	int ret = -1;
+	if (oufs_find_file(cwd, path, &parent, &child) == 1
+			&& oufs_read_inode_by_reference(child, &inode) == 0
+			&& vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) == 0) {
+		if (inode.type == IT_DIRECTORY) {
+			printf("export ZPWD=");
+			print_quoted(new_cwd);
+			printf(" ZPWD_INODE=%d:%u\n", child, master.master.namespace_generation);
+			ret = 0;
+		} else
+			fprintf(stderr, "%s is not a directory\n", new_cwd);
+	} else
+		fprintf(stderr, "%s does not exist\n", path);
+
+	// Clean up
+	oufs_disk_close();
+	return ret;
+}
@@ -0,0 +1,100 @@
+/**
+  Report the space used by a directory tree in the OU File System.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+// Subtree totals for every node of the walk
+int entries[OUFS_WALK_MAX_NODES];
+int blocks[OUFS_WALK_MAX_NODES];
+
+/**
+ * Print the totals of every directory below a node, then the node itself.
+ *
+ * @param nodes Node table filled in by oufs_walk()
+ * @param index Node to print
+ *
+ */
+void print_node(OUFS_WALK_NODE * nodes, int index) {
+	for (int i = nodes[index].first_child; i < nodes[index].first_child + nodes[index].n_children; i++)
+		if (nodes[i].inode.type == IT_DIRECTORY)
+			print_node(nodes, i);
+
+	printf("%d\t%d\t%s\n", blocks[index], entries[index], nodes[index].path);
+}
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Summary only?
+	int summary = 0;
+	if (argc > 1 && !strcmp(argv[1], "-s")) {
+		summary = 1;
+		argc--;
+		argv++;
+	}
+
+	// Check arguments
+	if (argc == 1 || argc == 2) {
+
+		// Open the virtual disk
+		oufs_disk_open(disk_name);
+
+		// With subtree counters on the disk, a summary needs no walk
+		char * path = argc == 2 ? argv[1] : ".";
+		OUFS_STAT stat;
+		BLOCK master;
+		if (summary && vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) == 0
+				&& (master.master.feature_flags & FEATURE_SUBTREE_COUNTERS)
+				&& oufs_stat_many(cwd, &path, 1, &stat) == 1 && stat.inode.type == IT_DIRECTORY) {
+			SUBTREE_COUNTER * counter = &master.master.subtree[stat.inode_reference];
+			printf("%d\t%d\t%s\n", counter->blocks, counter->entries, path);
+			oufs_disk_close();
+			return 0;
+		}
+
+		// Find everything below the specified directory
+		OUFS_WALK_NODE nodes[OUFS_WALK_MAX_NODES];
+		int n_nodes = oufs_walk(cwd, path, -1, nodes, OUFS_WALK_MAX_NODES);
+
+		if (n_nodes > 0) {
+			// Each node's own usage
+			for (int i = 0; i < n_nodes; i++) {
+				entries[i] = 0;
+				blocks[i] = 0;
+				for (int j = 0; j < BLOCKS_PER_INODE; j++)
+					if (nodes[i].inode.data[j] != UNALLOCATED_BLOCK) blocks[i]++;
+			}
+
+			// Children always come after their parent, so one backwards pass
+			//  rolls every subtree up into its root
+			for (int i = n_nodes - 1; i > 0; i--) {
+				entries[nodes[i].parent] += entries[i] + 1;
+				blocks[nodes[i].parent] += blocks[i];
+			}
+
+			if (summary)
+				printf("%d\t%d\t%s\n", blocks[0], entries[0], nodes[0].path);
+			else
+				print_node(nodes, 0);
+		}
+
+		// Clean up
+		oufs_disk_close();
+
+	} else {
+		// Wrong number of parameters
+		fprintf(stderr, "Usage: zdu [-s] [<dirname>]\n");
+	}
+
+}
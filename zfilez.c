@@ -5,38 +5,45 @@
 
 int main(int argc, char * argv[]) {
 
-	
+
 	// Fetch the key environment vars
 	char cwd[MAX_PATH_LENGTH];
 	char disk_name[MAX_PATH_LENGTH];
 	oufs_get_environment(cwd, disk_name);
 
-	// Check arguments
-	if (argc == 1) {
-
-		// Open the virtual disk
-		vdisk_disk_open(disk_name);
-
-		// List the specified directory
-		oufs_list(cwd, "./");
+	// Long and/or recursive listing?
+	int long_format = 0;
+	int recursive = 0;
+	while (argc > 1 && (!strcmp(argv[1], "-l") || !strcmp(argv[1], "-R"))) {
+		if (argv[1][1] == 'l')
+			long_format = 1;
+		else
+			recursive = 1;
+		argc--;
+		argv++;
+	}
 
-		// Clean up
-		vdisk_disk_close();
-	
-	} else if (argc == 2) {
+	// Check arguments
+	if (argc == 1 || argc == 2) {
 
 		// Open the virtual disk
-		vdisk_disk_open(disk_name);
+		oufs_disk_open(disk_name);
 
-		// List the specified directory
-		oufs_list(cwd, argv[1]);
+		// List the specified directory (cwd if none is given)
+		char * path = argc == 2 ? argv[1] : "./";
+		if (recursive)
+			oufs_list_recursive(cwd, argc == 2 ? path : ".", long_format);
+		else if (long_format)
+			oufs_list_long(cwd, path);
+		else
+			oufs_list(cwd, path);
 
 		// Clean up
-		vdisk_disk_close();
+		oufs_disk_close();
 
 	} else {
 		// Wrong number of parameters
-		fprintf(stderr, "Usage: zmkdir <dirname>\n");
+		fprintf(stderr, "Usage: zfilez [-l] [-R] [<dirname>]\n");
 	}
 
 }
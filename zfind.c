@@ -0,0 +1,96 @@
+/**
+  Search a directory tree in the OU File System.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Starting point comes first, if given
+	char * path = ".";
+	int arg = 1;
+	if (arg < argc && argv[arg][0] != '-')
+		path = argv[arg++];
+
+	// Predicates
+	char * name = NULL;
+	char * pattern = NULL;
+	char type = 0;
+	int min_depth = 0;
+	int max_depth = -1;
+	char terminator = '\n';
+
+	for (; arg < argc; arg++) {
+		if (!strcmp(argv[arg], "-print0")) {
+			terminator = 0;
+		} else if (arg + 1 == argc) {
+			break;
+		} else if (!strcmp(argv[arg], "-name")) {
+			name = argv[++arg];
+		} else if (!strcmp(argv[arg], "-regex")) {
+			pattern = argv[++arg];
+		} else if (!strcmp(argv[arg], "-type") && (!strcmp(argv[arg + 1], "d") || !strcmp(argv[arg + 1], "f"))) {
+			type = argv[++arg][0] == 'd' ? IT_DIRECTORY : IT_FILE;
+		} else if (!strcmp(argv[arg], "-mindepth") && sscanf(argv[arg + 1], "%d", &min_depth) == 1) {
+			arg++;
+		} else if (!strcmp(argv[arg], "-maxdepth") && sscanf(argv[arg + 1], "%d", &max_depth) == 1) {
+			arg++;
+		} else {
+			break;
+		}
+	}
+
+	if (arg < argc) {
+		// Unknown or incomplete predicate
+		fprintf(stderr, "Usage: zfind [<dirname>] [-name <glob>] [-regex <regex>] [-type d|f] [-mindepth <n>] [-maxdepth <n>] [-print0]\n");
+		return -1;
+	}
+
+	// The regular expression must match the whole path
+	regex_t regex;
+	if (pattern) {
+		char anchored[MAX_PATH_LENGTH + 5];
+		snprintf(anchored, sizeof(anchored), "^(%s)$", pattern);
+		if (regcomp(&regex, anchored, REG_EXTENDED | REG_NOSUB) != 0) {
+			fprintf(stderr, "Bad regular expression (%s)\n", pattern);
+			return -1;
+		}
+	}
+
+	// Open the virtual disk
+	oufs_disk_open(disk_name);
+
+	// Find everything down to the depth limit; the walk also fetches
+	//  every inode, so the type test needs no further reads
+	OUFS_WALK_NODE nodes[OUFS_WALK_MAX_NODES];
+	int n_nodes = oufs_walk(cwd, path, max_depth, nodes, OUFS_WALK_MAX_NODES);
+
+	for (int i = 0; i < n_nodes; i++) {
+		if (nodes[i].depth < min_depth) continue;
+		if (type && nodes[i].inode.type != type) continue;
+		if (name && fnmatch(name, i ? strrchr(nodes[i].path, '/') + 1 : nodes[i].path, 0) != 0) continue;
+		if (pattern && regexec(&regex, nodes[i].path, 0, NULL, 0) != 0) continue;
+
+		fputs(nodes[i].path, stdout);
+		putchar(terminator);
+	}
+
+	// Clean up
+	oufs_disk_close();
+	if (pattern) regfree(&regex);
+
+	return n_nodes < 0 ? -1 : 0;
+}
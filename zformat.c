@@ -8,12 +8,13 @@ int main(int argc, char** argv) {
 	oufs_get_environment(cwd, disk_name);
 
 	// Open the virtual disk
-	vdisk_disk_open(disk_name);
+	if (vdisk_disk_open(disk_name) != 0) return -1;
 
 	// Format the disk
-	oufs_format_disk(disk_name);
+	int ret = oufs_format_disk(disk_name) < 0 ? -1 : 0;
 
 	// Clean up
-	vdisk_disk_close();
+	if (vdisk_disk_close() < 0) ret = -1;
+	return ret;
 
 }
@@ -0,0 +1,258 @@
+/**
+  Check the optional metadata of the OU File System: subtree counters, the
+  path index, the directory Bloom filters, the order of directory
+  entries and the continuation entries of long names.  With -r, rebuild
+  them all and turn them on.  Without it, also check that the allocated
+  inodes and blocks are exactly those in use.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Rebuild instead of just checking?
+	int rebuild = argc == 2 && !strcmp(argv[1], "-r");
+	if (argc > 2 || (argc == 2 && !rebuild)) {
+		fprintf(stderr, "Usage: zfsck [-r]\n");
+		return -1;
+	}
+
+	// Open the virtual disk
+	if (oufs_disk_open(disk_name) != 0) return -1;
+
+	BLOCK master;
+	BLOCK index;
+	BLOCK filters;
+	SUBTREE_COUNTER counters[N_INODES];
+	int errors = 0;
+	if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) < 0 || oufs_compute_subtree_counters(counters) < 0
+			|| oufs_build_path_index(&index) < 0 || oufs_build_bloom_filters(&filters) < 0) {
+		fprintf(stderr, "Unable to walk the file system\n");
+		oufs_disk_close();
+		return -1;
+	}
+
+	if (rebuild) {
+		// Store the recomputed counters and keep them up to date from now on
+		memcpy(master.master.subtree, counters, sizeof(counters));
+		master.master.feature_flags |= FEATURE_SUBTREE_COUNTERS;
+
+		// Likewise the path index, in a block of its own
+		if (!(master.master.feature_flags & FEATURE_PATH_INDEX)) {
+			if (oufs_allocate_blocks(&master, 1, &master.master.path_index_block) < 1) {
+				fprintf(stderr, "No room for the path index\n");
+				errors++;
+			} else
+				master.master.feature_flags |= FEATURE_PATH_INDEX;
+		}
+		if ((master.master.feature_flags & FEATURE_PATH_INDEX)
+				&& vdisk_write_block(master.master.path_index_block, &index) < 0) errors++;
+
+		// And the Bloom filters, which also drops the bits of removed names
+		if (!(master.master.feature_flags & FEATURE_BLOOM_FILTERS)) {
+			if (oufs_allocate_blocks(&master, 1, &master.master.bloom_block) < 1) {
+				fprintf(stderr, "No room for the Bloom filters\n");
+				errors++;
+			} else
+				master.master.feature_flags |= FEATURE_BLOOM_FILTERS;
+		}
+		if ((master.master.feature_flags & FEATURE_BLOOM_FILTERS)
+				&& vdisk_write_block(master.master.bloom_block, &filters) < 0) errors++;
+
+		// Put every directory block in name order, which also drops stray
+		//  continuation entries
+		for (int i = 0; i < N_INODES; i++) {
+			INODE inode;
+			BLOCK block;
+			if (!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7)))) continue;
+			if (oufs_read_inode_by_reference(i, &inode) < 0 || inode.type != IT_DIRECTORY) continue;
+			if (vdisk_read_block(inode.data[0], &block) < 0) {
+				errors++;
+				continue;
+			}
+			int n = oufs_sort_directory(&block);
+			if (vdisk_write_block(inode.data[0], &block) < 0) errors++;
+			if (inode.size != n) {
+				inode.size = n;
+				if (oufs_write_inode_by_reference(i, &inode) < 0) errors++;
+			}
+		}
+		if (!errors)
+			master.master.feature_flags |= FEATURE_SORTED_DIRECTORIES | FEATURE_LONG_NAMES;
+
+		if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &master) < 0) errors++;
+		if (oufs_disk_close() < 0) errors++;
+		return errors ? -1 : 0;
+	}
+
+	if (master.master.feature_flags & FEATURE_SUBTREE_COUNTERS) {
+		// Report every directory whose stored counters are stale
+		for (int i = 0; i < N_INODES; i++) {
+			SUBTREE_COUNTER * stored = &master.master.subtree[i];
+			if (stored->entries != counters[i].entries || stored->blocks != counters[i].blocks || stored->bytes != counters[i].bytes) {
+				printf("Inode %d: subtree counters %d/%d/%d, expected %d/%d/%d\n", i,
+						stored->entries, stored->blocks, stored->bytes,
+						counters[i].entries, counters[i].blocks, counters[i].bytes);
+				errors++;
+			}
+		}
+	}
+
+	if (master.master.feature_flags & FEATURE_PATH_INDEX) {
+		// Report every directory that the stored index is wrong about.  Slots
+		//  depend on the order of insertion, so compare entries, not slots
+		BLOCK stored;
+		if (vdisk_read_block(master.master.path_index_block, &stored) < 0) errors++;
+		int n_stored = 0, n_expected = 0;
+		for (int i = 0; i < PATH_INDEX_SLOTS; i++) {
+			PATH_INDEX_ENTRY * expected = &index.path_index.entry[i];
+			if (stored.path_index.entry[i].inode_reference != 0) n_stored++;
+			if (expected->inode_reference == 0) continue;
+			n_expected++;
+
+			int j = 0;
+			while (j < PATH_INDEX_SLOTS && (stored.path_index.entry[j].inode_reference != expected->inode_reference
+					|| stored.path_index.entry[j].hash != expected->hash || stored.path_index.entry[j].parent != expected->parent))
+				j++;
+			if (j == PATH_INDEX_SLOTS) {
+				printf("Inode %d: missing from the path index\n", expected->inode_reference);
+				errors++;
+			}
+		}
+		if (n_stored != n_expected) {
+			printf("Path index holds %d directories, expected %d\n", n_stored, n_expected);
+			errors++;
+		}
+	}
+
+	if (master.master.feature_flags & FEATURE_BLOOM_FILTERS) {
+		// A filter may have extra bits, but must have those of every name
+		BLOCK stored;
+		if (vdisk_read_block(master.master.bloom_block, &stored) < 0) errors++;
+		for (int i = 0; i < N_INODES; i++) {
+			if ((stored.bloom.filter[i] & filters.bloom.filter[i]) != filters.bloom.filter[i]) {
+				printf("Inode %d: Bloom filter %08x is missing bits of %08x\n", i, stored.bloom.filter[i], filters.bloom.filter[i]);
+				errors++;
+			}
+		}
+	}
+
+	if (master.master.feature_flags & FEATURE_SORTED_DIRECTORIES) {
+		// Report every directory block that sorting would change
+		for (int i = 0; i < N_INODES; i++) {
+			INODE inode;
+			BLOCK stored, sorted;
+			if (!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7)))) continue;
+			if (oufs_read_inode_by_reference(i, &inode) < 0 || inode.type != IT_DIRECTORY) continue;
+			if (vdisk_read_block(inode.data[0], &stored) < 0) {
+				errors++;
+				continue;
+			}
+			sorted = stored;
+			oufs_sort_directory(&sorted);
+			for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; j++) {
+				if (stored.directory.entry[j].inode_reference != sorted.directory.entry[j].inode_reference
+						|| strncmp(stored.directory.entry[j].name, sorted.directory.entry[j].name, FILE_NAME_SIZE)) {
+					printf("Inode %d: directory entries are not in name order\n", i);
+					errors++;
+					break;
+				}
+			}
+		}
+	}
+
+	// Every allocated inode must be in the tree, and every allocated block
+	//  must be used by exactly one inode in it or by the metadata above.
+	//  Anything else has been leaked or is shared, for instance by an entry
+	//  written into a file's block as if it were a directory
+	OUFS_WALK_NODE nodes[OUFS_WALK_MAX_NODES];
+	int n_nodes = oufs_walk("/", "/", -1, nodes, OUFS_WALK_MAX_NODES);
+	if (n_nodes < 0) {
+		errors++;
+	} else {
+		unsigned char inode_used[N_INODES] = {0};
+		unsigned char block_users[N_BLOCKS_IN_DISK] = {0};
+		for (int i = 0; i <= N_INODE_BLOCKS; i++)
+			block_users[i] = 1;
+		if (master.master.feature_flags & FEATURE_PATH_INDEX)
+			block_users[master.master.path_index_block]++;
+		if (master.master.feature_flags & FEATURE_BLOOM_FILTERS)
+			block_users[master.master.bloom_block]++;
+		for (int i = 0; i < n_nodes; i++) {
+			inode_used[nodes[i].inode_reference] = 1;
+			for (int j = 0; j < BLOCKS_PER_INODE; j++)
+				if (nodes[i].inode.data[j] < N_BLOCKS_IN_DISK)
+					block_users[nodes[i].inode.data[j]]++;
+		}
+
+		for (int i = 0; i < N_INODES; i++) {
+			int allocated = (master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7))) != 0;
+			if (allocated != inode_used[i]) {
+				printf("Inode %d: %s\n", i, allocated ? "allocated but not in any directory" : "in use but not allocated");
+				errors++;
+			}
+		}
+		for (int i = 0; i < N_BLOCKS_IN_DISK; i++) {
+			int allocated = (master.master.block_allocated_flag[i >> 3] & (1 << (i & 7))) != 0;
+			if (block_users[i] > 1) {
+				printf("Block %d: used %d times\n", i, block_users[i]);
+				errors++;
+			} else if (allocated != block_users[i]) {
+				printf("Block %d: %s\n", i, allocated ? "allocated but not used" : "in use but not allocated");
+				errors++;
+			}
+		}
+	}
+
+	// Every directory starts with . (itself) and .., in slots 0 and 1.
+	//  Report continuation entries that do not carry on a name: ones on a
+	//  disk without long names, ones after a free slot or after an entry
+	//  whose name has already ended, and ones past LONG_NAME_ENTRIES
+	for (int i = 0; i < N_INODES; i++) {
+		INODE inode;
+		BLOCK block;
+		if (!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7)))) continue;
+		if (oufs_read_inode_by_reference(i, &inode) < 0 || inode.type != IT_DIRECTORY) continue;
+		if (vdisk_read_block(inode.data[0], &block) < 0) {
+			errors++;
+			continue;
+		}
+		DIRECTORY_ENTRY * entry = block.directory.entry;
+		if (entry[0].inode_reference != i || strcmp(entry[0].name, ".")
+				|| entry[1].inode_reference >= N_INODES || strcmp(entry[1].name, "..")) {
+			printf("Inode %d: . and .. are not the first two entries\n", i);
+			errors++;
+		}
+
+		int run = 0;
+		for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; j++) {
+			if (entry[j].inode_reference != CONTINUATION_INODE) {
+				run = entry[j].inode_reference != UNALLOCATED_INODE;
+				continue;
+			}
+			if (!(master.master.feature_flags & FEATURE_LONG_NAMES) || run == 0 || run == LONG_NAME_ENTRIES
+					|| memchr(entry[j - 1].name, 0, FILE_NAME_SIZE) != NULL) {
+				printf("Inode %d: entry %d does not continue a name\n", i, j);
+				errors++;
+				break;
+			}
+			run++;
+		}
+	}
+
+	// Clean up
+	if (oufs_disk_close() < 0) errors++;
+
+	return errors ? -1 : 0;
+}
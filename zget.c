@@ -0,0 +1,50 @@
+/**
+  Copy a file from the OU File System to the host.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Check arguments
+	if (argc == 3) {
+
+		// Open the virtual disk
+		oufs_disk_open(disk_name);
+
+		// Send the file straight into the host file
+		int ret = -1;
+		OUFILE * fp = oufs_fopen(cwd, argv[1], "r");
+		if (fp) {
+			int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (fd < 0) {
+				fprintf(stderr, "Unable to open %s\n", argv[2]);
+			} else {
+				if (oufs_sendfile(fp, fd, 0, -1) >= 0) ret = 0;
+				close(fd);
+			}
+			oufs_fclose(fp);
+		}
+
+		// Clean up
+		oufs_disk_close();
+		return ret;
+
+	} else {
+		// Wrong number of parameters
+		fprintf(stderr, "Usage: zget <filename> <host filename>\n");
+		return -1;
+	}
+
+}
@@ -31,6 +31,39 @@ int main(int argc, char** argv) {
 				}
 			}
 
+		}else if(strncmp(argv[1], "-fill", 6) == 0) {
+			// Fill factor of every directory block
+			BLOCK master;
+			if(vdisk_read_block(0, &master) != 0) {
+				fprintf(stderr, "Error reading master block\n");
+			}else{
+				int live_total = 0, dead_total = 0, n_dirs = 0;
+				printf("Inode Block Live Dead Fill\n");
+				for(int i = 0; i < N_INODES; ++i) {
+					INODE inode;
+					BLOCK block;
+					if(!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7)))) continue;
+					if(oufs_read_inode_by_reference(i, &inode) != 0 || inode.type != IT_DIRECTORY) continue;
+					if(vdisk_read_block(inode.data[0], &block) != 0) continue;
+
+					// Continuation entries of long names count as live
+					int live = 0;
+					for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+						if(block.directory.entry[j].inode_reference != UNALLOCATED_INODE) live++;
+					}
+					int dead = oufs_directory_dead_slots(&block);
+					printf("%5d %5d %4d %4d %3d%%\n", i, inode.data[0], live, dead,
+							(int) (100 * live / DIRECTORY_ENTRIES_PER_BLOCK));
+					live_total += live;
+					dead_total += dead;
+					n_dirs++;
+				}
+				if(n_dirs > 0) {
+					printf("%d directories: %d live entries, %d dead slots, %d%% full\n", n_dirs, live_total, dead_total,
+							(int) (100 * live_total / (n_dirs * DIRECTORY_ENTRIES_PER_BLOCK)));
+				}
+			}
+
 		}else{
 			fprintf(stderr, "Unknown argument (%s)\n", argv[1]);
 		}
@@ -90,9 +123,12 @@ int main(int argc, char** argv) {
 					vdisk_read_block(index, &block);
 					printf("Directory at block %d:\n", index);
 					for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-						if(block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-							printf("Entry %d: name=\"%s\", inode=%d\n", i, block.directory.entry[i].name,
+						char name[LONG_NAME_SIZE];
+						if(oufs_entry_name(&block, i, name) > 0) {
+							printf("Entry %d: name=\"%s\", inode=%d\n", i, name,
 									block.directory.entry[i].inode_reference);
+						}else if(block.directory.entry[i].inode_reference == CONTINUATION_INODE) {
+							printf("Entry %d: continued\n", i);
 						}
 					}
 				}
@@ -0,0 +1,47 @@
+/**
+  Copy a host file into the OU File System.
+
+  CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char * argv[]) {
+
+	// Fetch the key environment vars
+	char cwd[MAX_PATH_LENGTH];
+	char disk_name[MAX_PATH_LENGTH];
+	oufs_get_environment(cwd, disk_name);
+
+	// Check arguments
+	if (argc == 3) {
+
+		// "-" reads from stdin
+		int fd = strcmp(argv[1], "-") ? open(argv[1], O_RDONLY) : STDIN_FILENO;
+		if (fd < 0) {
+			fprintf(stderr, "Unable to open %s\n", argv[1]);
+			return -1;
+		}
+
+		// Open the virtual disk
+		oufs_disk_open(disk_name);
+
+		// Copy the host file in
+		int ret = oufs_import_fd(cwd, argv[2], fd) < 0 ? -1 : 0;
+
+		// Clean up.  Closing commits the changes, which can still fail
+		if (oufs_disk_close() < 0) ret = -1;
+		if (fd != STDIN_FILENO) close(fd);
+		return ret;
+
+	} else {
+		// Wrong number of parameters
+		fprintf(stderr, "Usage: zput <host filename> <filename>\n");
+		return -1;
+	}
+
+}
@@ -22,17 +22,19 @@ int main(int argc, char * argv[]) {
 	if (argc == 2) {
 
 		// Open the virtual disk
-		vdisk_disk_open(disk_name);
+		oufs_disk_open(disk_name);
 
 		// Remove the specified directory
-		oufs_rmdir(cwd, argv[1]);
+		int ret = oufs_rmdir(cwd, argv[1]) < 0 ? -1 : 0;
 
-		// Clean up
-		vdisk_disk_close();
+		// Clean up.  Closing commits the changes, which can still fail
+		if (oufs_disk_close() < 0) ret = -1;
+		return ret;
 
 	} else {
 		// Wrong number of parameters
 		fprintf(stderr, "Usage: zmkdir <dirname>\n");
+		return -1;
 	}
 
 }